@@ -0,0 +1,122 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "reactor.h"
+#include "capture.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The capture file, or NULL.
+static FILE *capture_file = NULL;
+
+// When the capture started, in nanoseconds of the monotonic clock.
+static uint64_t capture_start = 0;
+
+/*
+ * @brief Get the current time of a clock.
+ * @param clock The clock.
+ * @return The current time, in nanoseconds.
+*/
+static uint64_t capture_now(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * @brief Write a record to the capture file.
+ * @param kind The kind of the record.
+ * @param conn The reference ID of the client.
+ * @param data The data of the record, or NULL.
+ * @param len The length of the data, in bytes.
+*/
+static void capture_write(capture_kind_t kind, uint32_t conn, const void *data, size_t len) {
+	if (capture_file == NULL)
+		return;
+
+	capture_record_t record = {
+		.timestamp = capture_now(CLOCK_MONOTONIC) - capture_start,
+		.conn = conn,
+		.kind = (uint16_t)kind,
+		.len = (uint16_t)(len > UINT16_MAX ? UINT16_MAX : len)
+	};
+
+	// Buffered, so a record costs a copy and not a syscall.
+	if (fwrite(&record, sizeof(record), 1, capture_file) != 1 || (record.len > 0 && fwrite(data, record.len, 1, capture_file) != 1))
+	{
+		fprintf(stderr, "%s Capture write failed: %s, capture stopped.\n", C_PREFIX_ERROR, strerror(errno));
+		capture_close();
+	}
+}
+
+int capture_open() {
+	char path[PATH_MAX];
+	capture_header_t header;
+
+	snprintf(path, sizeof(path), CAPTURE_PATH, (int)getpid());
+
+	if ((capture_file = fopen(path, "wbe")) == NULL)
+	{
+		fprintf(stderr, "%s fopen(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(errno));
+		return -1;
+	}
+
+	setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER);
+
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.start = capture_now(CLOCK_REALTIME);
+	capture_start = capture_now(CLOCK_MONOTONIC);
+
+	if (fwrite(&header, sizeof(header), 1, capture_file) != 1)
+	{
+		fprintf(stderr, "%s fwrite() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		fclose(capture_file);
+		capture_file = NULL;
+		return -1;
+	}
+
+	fprintf(stdout, "%s Capturing inbound traffic to %s.\n", C_PREFIX_INFO, path);
+
+	return 0;
+}
+
+void capture_close() {
+	if (capture_file == NULL)
+		return;
+
+	fclose(capture_file);
+	capture_file = NULL;
+}
+
+void capture_accept(uint32_t conn) {
+	capture_write(CAPTURE_ACCEPT, conn, NULL, 0);
+}
+
+void capture_data(uint32_t conn, const void *data, size_t len) {
+	capture_write(CAPTURE_DATA, conn, data, len);
+}
+
+void capture_disconnect(uint32_t conn) {
+	capture_write(CAPTURE_DISCONNECT, conn, NULL, 0);
+}
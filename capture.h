@@ -0,0 +1,167 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief Defines whether the server captures its inbound traffic, to be replayed later with the replay tool.
+ * @note The default value is 0.
+ * @note A value of 1 means that every accepted connection, every inbound chunk and every disconnection
+ * 			are written to a capture file, with their timestamps.
+*/
+#define SERVER_CAPTURE		0
+
+/*
+ * @brief The path of the capture file, formatted with the server's process ID.
+ * @note The default path is /tmp/react_server.<pid>.cap, so a hot restart starts a capture file of its own.
+*/
+#define CAPTURE_PATH		"/tmp/react_server.%d.cap"
+
+/*
+ * @brief The size of the capture file's write buffer, in bytes.
+ * @note The default size is 1 MB.
+*/
+#define CAPTURE_BUFFER		(1 << 20)
+
+/*
+ * @brief The magic number at the start of every capture file.
+*/
+#define CAPTURE_MAGIC		"RSCAPT01"
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief The kind of a capture record.
+*/
+typedef enum _capture_kind_t {
+	CAPTURE_ACCEPT = 1,
+	CAPTURE_DATA = 2,
+	CAPTURE_DISCONNECT = 3
+} capture_kind_t;
+
+/*
+ * @brief The header of a capture file.
+*/
+typedef struct _capture_header_t capture_header_t, *capture_header_t_ptr;
+
+/*
+ * @brief A single record in a capture file, followed by its data (for CAPTURE_DATA records).
+*/
+typedef struct _capture_record_t capture_record_t, *capture_record_t_ptr;
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief The header of a capture file.
+ * @note Capture files are written in the host's byte order.
+*/
+struct _capture_header_t
+{
+	/*
+	 * @brief The magic number, CAPTURE_MAGIC.
+	*/
+	char magic[8];
+
+	/*
+	 * @brief When the capture started, in nanoseconds since the epoch.
+	*/
+	uint64_t start;
+};
+
+/*
+ * @brief A single record in a capture file, followed by its data (for CAPTURE_DATA records).
+*/
+struct _capture_record_t
+{
+	/*
+	 * @brief When the record was captured, in nanoseconds since the capture started.
+	*/
+	uint64_t timestamp;
+
+	/*
+	 * @brief The connection, by the reference ID of its client.
+	*/
+	uint32_t conn;
+
+	/*
+	 * @brief The kind of the record, see capture_kind_t.
+	*/
+	uint16_t kind;
+
+	/*
+	 * @brief The length of the data that follows, in bytes.
+	*/
+	uint16_t len;
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Start capturing to a new capture file.
+ * @return 0 on success, -1 otherwise.
+*/
+int capture_open();
+
+/*
+ * @brief Flush and close the capture file.
+ * @return void
+*/
+void capture_close();
+
+/*
+ * @brief Capture an accepted connection.
+ * @param conn The reference ID of the client.
+ * @return void
+*/
+void capture_accept(uint32_t conn);
+
+/*
+ * @brief Capture an inbound chunk, as it was read.
+ * @param conn The reference ID of the client.
+ * @param data The chunk.
+ * @param len The length of the chunk, in bytes.
+ * @return void
+*/
+void capture_data(uint32_t conn, const void *data, size_t len);
+
+/*
+ * @brief Capture a disconnection.
+ * @param conn The reference ID of the client.
+ * @return void
+*/
+void capture_disconnect(uint32_t conn);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include "reactor.h"
+#include <stdatomic.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief The number of messages a channel holds.
+ * @note The default value is 1024 messages.
+ * @note Must be a power of 2.
+*/
+#define CHANNEL_CAPACITY	1024
+
+/*
+ * @brief The maximum number of messages the receiving reactor handles per wakeup.
+ * @note The default value is 256 messages.
+ * @note Keeps a busy channel from starving the other file descriptors of its reactor - the rest is handled on its next round.
+*/
+#define CHANNEL_BATCH		256
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief A reference counted message, shared by all the reactors it's sent to.
+*/
+typedef struct _channel_msg_t channel_msg_t, *channel_msg_t_ptr;
+
+/*
+ * @brief A bounded lock-free single-producer single-consumer channel of messages, from one reactor to another.
+*/
+typedef struct _channel_t channel_t, *channel_t_ptr;
+
+/*
+ * @brief The handler of the messages a reactor receives on a channel.
+ * @param msg The message - the channel releases its reference once the handler returns.
+ * @param react The receiving reactor.
+ * @return void
+*/
+typedef void (*channel_handler_t)(channel_msg_t_ptr msg, void *react);
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief A reference counted message, shared by all the reactors it's sent to.
+ * @note Sending a message to many reactors only copies a pointer per reactor.
+*/
+struct _channel_msg_t
+{
+	/*
+	 * @brief The number of references - the message is freed when it drops to 0.
+	*/
+	atomic_uint refs;
+
+	/*
+	 * @brief The file descriptor of the sender, or -1.
+	*/
+	int sender;
+
+	/*
+	 * @brief The length of the message, in bytes.
+	*/
+	uint32_t len;
+
+	/*
+	 * @brief The message itself.
+	*/
+	char data[];
+};
+
+/*
+ * @brief A bounded lock-free single-producer single-consumer channel of messages, from one reactor to another.
+ * @note Every field is on the cache line of whoever writes it - the producer's fields with head, the consumer's
+ * 			with tail, and armed, which both write, on a line of its own. The fields that are only read after the
+ * 			channel is created share another line, so no write of one side evicts what the other reads per message.
+*/
+struct _channel_t
+{
+	/*
+	 * @brief The next slot the producer writes to.
+	*/
+	_Alignas(64) atomic_size_t head;
+
+	/*
+	 * @brief The number of messages sent since the last channelFlush().
+	 * @note Only written by the producer.
+	*/
+	size_t pending;
+
+	/*
+	 * @brief The number of times the producer rang the doorbell.
+	 * @note Only written by the producer.
+	*/
+	uint64_t wakeups;
+
+	/*
+	 * @brief The number of messages that didn't fit in the channel.
+	 * @note Only written by the producer.
+	*/
+	uint64_t dropped;
+
+	/*
+	 * @brief The next slot the consumer reads from.
+	*/
+	_Alignas(64) atomic_size_t tail;
+
+	/*
+	 * @brief Whether the receiving reactor found the channel empty, and waits for its doorbell.
+	 * @note Set by the consumer when it runs out of messages, and cleared by whoever wakes it up - so only
+	 * 			the first flush after it went idle rings the doorbell.
+	*/
+	_Alignas(64) atomic_bool armed;
+
+	/*
+	 * @brief The eventfd that wakes the receiving reactor up, registered with it as an internal file descriptor.
+	 * @note Never written after the channel is created.
+	*/
+	_Alignas(64) int doorbell;
+
+	/*
+	 * @brief The handler of the received messages.
+	 * @note Never written after the channel is created.
+	*/
+	channel_handler_t handler;
+
+	/*
+	 * @brief The messages in the channel.
+	*/
+	_Alignas(64) channel_msg_t_ptr slots[CHANNEL_CAPACITY];
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Create a message with a single reference, owned by the caller.
+ * @param data The message.
+ * @param len The length of the message, in bytes.
+ * @param sender The file descriptor of the sender, or -1.
+ * @return The message, or NULL on failure.
+*/
+channel_msg_t_ptr channelMsgCreate(const void *data, uint32_t len, int sender);
+
+/*
+ * @brief Take another reference to a message.
+ * @param msg The message.
+ * @return void
+*/
+void channelMsgRetain(channel_msg_t_ptr msg);
+
+/*
+ * @brief Drop a reference to a message, and free it if it was the last one.
+ * @param msg The message.
+ * @return void
+*/
+void channelMsgRelease(channel_msg_t_ptr msg);
+
+/*
+ * @brief Create a channel to a reactor.
+ * @param react The receiving reactor.
+ * @param handler The handler of the received messages, called from the receiving reactor's thread.
+ * @return The channel, or NULL on failure.
+ * @note Must be called before the receiving reactor starts, or from its thread, as it adds the doorbell to it.
+ * @note The receiving reactor owns the channel, see destroyChannel().
+*/
+void *createChannel(void *react, channel_handler_t handler);
+
+/*
+ * @brief Send a message to the channel's reactor.
+ * @param channel The channel.
+ * @param msg The message - the channel takes a reference of its own.
+ * @return true on success, false if the channel is full.
+ * @note Must only be called by a single producer (e.g. the sending reactor's thread), and takes no lock.
+ * @note Doesn't wake the receiving reactor up, see channelFlush().
+*/
+bool channelSend(void *channel, channel_msg_t_ptr msg);
+
+/*
+ * @brief Wake the channel's reactor up, to handle the messages sent since the last flush.
+ * @param channel The channel.
+ * @return void
+ * @note Called by the producer at the end of a batch (e.g. at the end of its handler), so a batch costs
+ * 			at most one wakeup - and none if the receiving reactor is still busy with the previous one, or
+ * 			was already woken up since it last found the channel empty, see channel_t.armed.
+*/
+void channelFlush(void *channel);
+
+/*
+ * @brief Destroy a channel, and release the messages left in it.
+ * @param react The receiving reactor.
+ * @param channel The channel.
+ * @return void
+ * @note Both reactors must be stopped, or the receiving reactor must call it from its own thread
+ * 			after the producer is done with the channel.
+*/
+void destroyChannel(void *react, void *channel);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COROUTINE_H
+#define _COROUTINE_H
+
+#include "reactor.h"
+#include <sys/types.h>
+#include <ucontext.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief The stack size of each coroutine, in bytes.
+ * @note The default size is 64 KB.
+ * @note Each stack has an extra guard page below it, so an overflow faults instead of corrupting memory.
+*/
+#define CO_STACK_SIZE		(64 * 1024)
+
+/*
+ * @brief The maximum number of free stacks kept for reuse, per thread.
+ * @note The default value is 64.
+ * @note Stacks above the limit are unmapped when their coroutine finishes.
+*/
+#define CO_POOL_SIZE		64
+
+/*
+ * @brief Defines whether coroutines switch with a hand-written context switch, instead of swapcontext().
+ * @note swapcontext() saves and restores the signal mask on every switch, which is a system call (rt_sigprocmask),
+ * 			the hand-written switch only saves the callee-saved registers and the stack pointer.
+ * @note Only available on x86-64, and not with shadow stacks (-fcf-protection, which defines __CET__), as a shadow
+ * 			stack can't follow a switch to another stack. swapcontext() is used anywhere else.
+*/
+#if defined(__x86_64__) && !defined(__CET__)
+	#define CO_FAST_SWITCH	1
+#else
+	#define CO_FAST_SWITCH	0
+#endif
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief A coroutine - sequential code that runs on a stack of its own, and yields to the reactor instead of blocking.
+*/
+typedef struct _coroutine_t coroutine_t, *coroutine_t_ptr;
+
+/*
+ * @brief The body of a coroutine.
+ * @param fd The file descriptor the coroutine serves.
+ * @param react The reactor.
+ * @param arg The argument given to co_spawn().
+ * @return void
+ * @note The coroutine owns the file descriptor, and closes it before it returns.
+*/
+typedef void (*co_func_t)(int fd, void *react, void *arg);
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief A coroutine - sequential code that runs on a stack of its own, and yields to the reactor instead of blocking.
+*/
+struct _coroutine_t
+{
+#if CO_FAST_SWITCH
+	/*
+	 * @brief The coroutine's saved stack pointer, while it's suspended - its registers are saved on its stack.
+	*/
+	void *sp;
+
+	/*
+	 * @brief The reactor's saved stack pointer, while the coroutine runs.
+	*/
+	void *caller_sp;
+#else
+	/*
+	 * @brief The coroutine's saved context, while it's suspended.
+	*/
+	ucontext_t context;
+
+	/*
+	 * @brief The reactor's saved context, while the coroutine runs.
+	*/
+	ucontext_t caller;
+#endif
+
+	/*
+	 * @brief The coroutine's stack mapping, guard page included.
+	*/
+	void *stack;
+
+	/*
+	 * @brief The reactor the coroutine runs in.
+	*/
+	void *react;
+
+	/*
+	 * @brief The file descriptor the coroutine serves.
+	*/
+	int fd;
+
+	/*
+	 * @brief The reactor node of the coroutine's file descriptor.
+	 * @note Safe to keep, as removing the node releases the coroutine.
+	*/
+	reactor_node_ptr node;
+
+	/*
+	 * @brief Another file descriptor the coroutine waits on (e.g. a timer), or -1.
+	*/
+	int wait_fd;
+
+	/*
+	 * @brief Whether wait_fd is a duplicate made by the coroutine, and closed by it.
+	 * @note A file descriptor that's already in the reactor (e.g. another client) is waited on through a duplicate.
+	*/
+	bool wait_dup;
+
+	/*
+	 * @brief The timer of a sleeping coroutine, or -1.
+	*/
+	int timer_fd;
+
+	/*
+	 * @brief The body of the coroutine.
+	*/
+	co_func_t func;
+
+	/*
+	 * @brief The argument of the coroutine's body.
+	*/
+	void *arg;
+
+	/*
+	 * @brief Whether the coroutine is currently running.
+	*/
+	bool running;
+
+	/*
+	 * @brief Whether the coroutine's body returned.
+	*/
+	bool finished;
+
+	/*
+	 * @brief Whether the coroutine's file descriptor was removed while it was running.
+	 * @note The coroutine is then freed as soon as it yields.
+	*/
+	bool released;
+
+	/*
+	 * @brief Whether the coroutine was cancelled - its file descriptor was removed from the reactor.
+	 * @note Every wait of a cancelled coroutine fails with ECANCELED right away, so it unwinds and cleans up.
+	*/
+	bool cancelled;
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Add a file descriptor to the reactor, served by a coroutine.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor, it's made non-blocking.
+ * @param func The body of the coroutine.
+ * @param arg The argument of the coroutine's body.
+ * @return 0 on success, -1 otherwise.
+ * @note The coroutine starts on the reactor's next round. Per-connection state may still be attached
+ * 			with setFdContext() meanwhile.
+ * @note Removing the file descriptor from the reactor cancels the coroutine - it's resumed one last time, with all of its
+ * 			waits (and co_read(), co_write() and co_sleep()) failing with ECANCELED, so it runs its cleanup and returns,
+ * 			while its context is still attached. Then it's freed.
+*/
+int co_spawn(void *react, int fd, co_func_t func, void *arg);
+
+/*
+ * @brief Suspend the current coroutine until a file descriptor is ready.
+ * @param fd The file descriptor - the coroutine's own, one that isn't in the reactor, or one that's served
+ * 			by another handler (e.g. another client), which is then waited on through a duplicate.
+ * @param events The events to wait for, POLLIN or POLLOUT.
+ * @return 0 on success, -1 otherwise (e.g. when not called from a coroutine, or ECANCELED when it was cancelled).
+ * @note A hang up or an error on the file descriptor wakes the coroutine up too, the next call on it reports it.
+*/
+int co_wait(int fd, short events);
+
+/*
+ * @brief Read from a file descriptor, yielding to the reactor until it's readable.
+ * @param fd The file descriptor, see co_wait().
+ * @param buf The buffer to read to.
+ * @param len The size of the buffer, in bytes.
+ * @return The number of bytes read, 0 on end of file, or -1 on error.
+ * @note Outside a coroutine, this is just read().
+*/
+ssize_t co_read(int fd, void *buf, size_t len);
+
+/*
+ * @brief Write a whole buffer to a file descriptor, yielding to the reactor while it's full.
+ * @param fd The file descriptor, see co_wait().
+ * @param buf The buffer to write.
+ * @param len The length of the buffer, in bytes.
+ * @return The number of bytes written, or -1 on error.
+ * @note Outside a coroutine, this is just write().
+*/
+ssize_t co_write(int fd, const void *buf, size_t len);
+
+/*
+ * @brief Suspend the current coroutine for a while, letting the reactor serve the others.
+ * @param usec For how long to sleep, in microseconds.
+ * @return 0 on success, -1 otherwise (e.g. when not called from a coroutine).
+ * @note The coroutine's own file descriptor is paused while it sleeps.
+*/
+int co_sleep(uint64_t usec);
+
+/*
+ * @brief Release the coroutine of a file descriptor that's being removed from the reactor.
+ * @param co The coroutine.
+ * @param fd The removed file descriptor - only the coroutine's own releases it.
+ * @return void
+ * @note Called by the reactor, see reactorRemoveNode(), before the node is unlinked - a suspended coroutine
+ * 			is cancelled and runs to its end, a running one is cancelled and freed once it yields.
+*/
+void coroutineRelease(void *co, int fd);
+
+#endif
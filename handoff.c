@@ -0,0 +1,490 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "reactor.h"
+#include "coroutine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The reactor pointer.
+extern void *reactor;
+
+// The number of clients connected to the server in its lifetime.
+extern uint32_t client_count;
+
+// The total number of bytes received from clients in the server's lifetime.
+extern uint64_t total_bytes_received;
+
+// The total number of bytes sent to clients in the server's lifetime.
+extern uint64_t total_bytes_sent;
+
+// The number of clients currently connected to the server.
+extern uint32_t active_clients;
+
+// Tells a handoff socket apart from anything else, "RSHO".
+#define HANDOFF_MAGIC		0x5253484FU
+
+// The version of the record layout, bumped whenever a field is added, removed or changes its meaning.
+#define HANDOFF_VERSION		1
+
+// The size of the header, in bytes - the magic, the version and the record size, never changes.
+#define HANDOFF_HEADER_SIZE	12
+
+// The size of a record of this version, in bytes, see handoff_encode_client().
+#define HANDOFF_RECORD_SIZE	68
+
+// The largest record the new process reads, in bytes - anything larger isn't a handoff socket.
+#define HANDOFF_RECORD_MAX	4096
+
+/*
+ * @brief The kind of a handoff record.
+ * @note The kind is always the first field of a record, in every version, so the listeners can be taken over
+ * 			even from a process with a different record layout.
+*/
+typedef enum _handoff_kind
+{
+	HANDOFF_STATS = 0,		// The server statistics, always the first record, without a file descriptor.
+	HANDOFF_LISTENER,		// A listening socket.
+	HANDOFF_CLIENT,			// A client socket, with its per-connection state.
+	HANDOFF_END				// The last record, without a file descriptor.
+} handoff_kind_t;
+
+/*
+ * @brief Write a 32-bit field of a record, and move past it.
+ * @param pos The position in the record.
+ * @param value The value of the field.
+ * @return void
+*/
+static void handoff_put_u32(uint8_t **pos, uint32_t value) {
+	memcpy(*pos, &value, sizeof(value));
+	*pos += sizeof(value);
+}
+
+/*
+ * @brief Write a 64-bit field of a record, and move past it.
+ * @param pos The position in the record.
+ * @param value The value of the field.
+ * @return void
+*/
+static void handoff_put_u64(uint8_t **pos, uint64_t value) {
+	memcpy(*pos, &value, sizeof(value));
+	*pos += sizeof(value);
+}
+
+/*
+ * @brief Write a floating point field of a record, as its 64-bit representation, and move past it.
+ * @param pos The position in the record.
+ * @param value The value of the field.
+ * @return void
+*/
+static void handoff_put_double(uint8_t **pos, double value) {
+	uint64_t bits = 0;
+
+	memcpy(&bits, &value, sizeof(bits));
+	handoff_put_u64(pos, bits);
+}
+
+/*
+ * @brief Read a 32-bit field of a record, and move past it.
+ * @param pos The position in the record.
+ * @return The value of the field.
+*/
+static uint32_t handoff_get_u32(const uint8_t **pos) {
+	uint32_t value = 0;
+
+	memcpy(&value, *pos, sizeof(value));
+	*pos += sizeof(value);
+
+	return value;
+}
+
+/*
+ * @brief Read a 64-bit field of a record, and move past it.
+ * @param pos The position in the record.
+ * @return The value of the field.
+*/
+static uint64_t handoff_get_u64(const uint8_t **pos) {
+	uint64_t value = 0;
+
+	memcpy(&value, *pos, sizeof(value));
+	*pos += sizeof(value);
+
+	return value;
+}
+
+/*
+ * @brief Read a floating point field of a record, and move past it.
+ * @param pos The position in the record.
+ * @return The value of the field.
+*/
+static double handoff_get_double(const uint8_t **pos) {
+	uint64_t bits = handoff_get_u64(pos);
+	double value = 0;
+
+	memcpy(&value, &bits, sizeof(value));
+
+	return value;
+}
+
+/*
+ * @brief Encode a record of this version, field by field, independently of the layout of client_t.
+ * @param record The record, HANDOFF_RECORD_SIZE bytes.
+ * @param kind The kind of the record.
+ * @param client The per-connection state of a client, the statistics of the server for HANDOFF_STATS, or NULL.
+ * @return void
+ * @note The layout is the kind, the ID (the lifetime client count for HANDOFF_STATS), the bytes received and sent,
+ * 			the bucket's limits, tokens and last refill, the number of times throttled, and the UDP token.
+ * 			The shared-memory session, the relay state and the replay don't survive a restart, and aren't sent.
+*/
+static void handoff_encode_client(uint8_t *record, handoff_kind_t kind, const client_t *client) {
+	client_t empty;
+	uint8_t *pos = record;
+
+	if (client == NULL)
+	{
+		memset(&empty, 0, sizeof(empty));
+		client = &empty;
+	}
+
+	handoff_put_u32(&pos, (uint32_t)kind);
+	handoff_put_u32(&pos, client->id);
+	handoff_put_u64(&pos, client->bytes_received);
+	handoff_put_u64(&pos, client->bytes_sent);
+	handoff_put_u32(&pos, client->bucket.limit.bytes_per_sec);
+	handoff_put_u32(&pos, client->bucket.limit.msgs_per_sec);
+	handoff_put_double(&pos, client->bucket.bytes);
+	handoff_put_double(&pos, client->bucket.msgs);
+	handoff_put_u64(&pos, client->bucket.last_refill);
+	handoff_put_u32(&pos, client->throttled);
+	handoff_put_u64(&pos, client->udp_token);
+}
+
+/*
+ * @brief Decode a record of this version into the per-connection state of a client.
+ * @param record The record, HANDOFF_RECORD_SIZE bytes.
+ * @param client The state to fill, the fields that aren't sent are zeroed.
+ * @return void
+*/
+static void handoff_decode_client(const uint8_t *record, client_t_ptr client) {
+	const uint8_t *pos = record + sizeof(uint32_t);
+
+	memset(client, 0, sizeof(client_t));
+
+	client->id = handoff_get_u32(&pos);
+	client->bytes_received = handoff_get_u64(&pos);
+	client->bytes_sent = handoff_get_u64(&pos);
+	client->bucket.limit.bytes_per_sec = handoff_get_u32(&pos);
+	client->bucket.limit.msgs_per_sec = handoff_get_u32(&pos);
+	client->bucket.bytes = handoff_get_double(&pos);
+	client->bucket.msgs = handoff_get_double(&pos);
+	client->bucket.last_refill = handoff_get_u64(&pos);
+	client->throttled = handoff_get_u32(&pos);
+	client->udp_token = handoff_get_u64(&pos);
+}
+
+/*
+ * @brief Send a single handoff record, optionally with a file descriptor.
+ * @param sock The handoff socket.
+ * @param record The record to send.
+ * @param len The size of the record.
+ * @param fd The file descriptor to pass, or -1 for none.
+ * @return 0 on success, -1 otherwise.
+*/
+static int handoff_send_record(int sock, const uint8_t *record, size_t len, int fd) {
+	struct iovec iov = { .iov_base = (void *)record, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	if (fd >= 0)
+	{
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(sock, &msg, 0) != (ssize_t)len)
+	{
+		fprintf(stderr, "%s sendmsg() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Receive a single handoff record, and the file descriptor it carries, if any.
+ * @param sock The handoff socket.
+ * @param record The record to fill.
+ * @param len The size of the record.
+ * @param fd Filled with the received file descriptor, or -1 for none.
+ * @return 0 on success, -1 otherwise.
+*/
+static int handoff_receive_record(int sock, uint8_t *record, size_t len, int *fd) {
+	struct iovec iov = { .iov_base = record, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&control, 0, sizeof(control));
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	*fd = -1;
+
+	ssize_t bytes_read = recvmsg(sock, &msg, MSG_WAITALL);
+
+	if (bytes_read != (ssize_t)len)
+	{
+		fprintf(stderr, "%s recvmsg() failed: %s\n", C_PREFIX_ERROR, (bytes_read < 0 ? strerror(errno) : "short handoff record"));
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return 0;
+}
+
+int handoff_send(int sock, bool clients, uint32_t *sent_clients) {
+	uint8_t header[HANDOFF_HEADER_SIZE], record[HANDOFF_RECORD_SIZE];
+	uint8_t *pos = header;
+	client_t stats;
+	int listeners = 0;
+
+	*sent_clients = 0;
+
+	if (reactor == NULL)
+	{
+		fprintf(stderr, "%s handoff_send() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return -1;
+	}
+
+	handoff_put_u32(&pos, HANDOFF_MAGIC);
+	handoff_put_u32(&pos, HANDOFF_VERSION);
+	handoff_put_u32(&pos, HANDOFF_RECORD_SIZE);
+
+	if (handoff_send_record(sock, header, sizeof(header), -1) < 0)
+		return -1;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.id = client_count;
+	stats.bytes_received = total_bytes_received;
+	stats.bytes_sent = total_bytes_sent;
+
+	handoff_encode_client(record, HANDOFF_STATS, &stats);
+
+	if (handoff_send_record(sock, record, sizeof(record), -1) < 0)
+		return -1;
+
+	for (reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head; curr != NULL; curr = curr->next)
+	{
+		if (curr->type == FD_TYPE_LISTENER)
+		{
+			handoff_encode_client(record, HANDOFF_LISTENER, NULL);
+			listeners++;
+		}
+
+		// Shared-memory sessions can't be handed off, their clients reconnect to the new process.
+		else if (clients && curr->type == FD_TYPE_CLIENT && (curr->ctx == NULL || ((client_t_ptr)curr->ctx)->shm == NULL))
+		{
+			handoff_encode_client(record, HANDOFF_CLIENT, (client_t_ptr)curr->ctx);
+			(*sent_clients)++;
+		}
+
+		else
+			continue;
+
+		if (handoff_send_record(sock, record, sizeof(record), curr->fd) < 0)
+			return -1;
+	}
+
+	handoff_encode_client(record, HANDOFF_END, NULL);
+
+	if (handoff_send_record(sock, record, sizeof(record), -1) < 0)
+		return -1;
+
+	return listeners;
+}
+
+int handoff_receive(int sock, bool *took_clients) {
+	uint8_t header[HANDOFF_HEADER_SIZE], record[HANDOFF_RECORD_MAX];
+	const uint8_t *pos = header;
+	int fd = -1, listeners = 0, clients = 0;
+
+	*took_clients = false;
+
+	if (reactor == NULL)
+	{
+		fprintf(stderr, "%s handoff_receive() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return -1;
+	}
+
+	if (handoff_receive_record(sock, header, sizeof(header), &fd) < 0)
+		return -1;
+
+	if (fd >= 0)
+		close(fd);
+
+	uint32_t magic = handoff_get_u32(&pos);
+	uint32_t version = handoff_get_u32(&pos);
+	uint32_t record_size = handoff_get_u32(&pos);
+
+	if (magic != HANDOFF_MAGIC || record_size < sizeof(uint32_t) || record_size > HANDOFF_RECORD_MAX)
+	{
+		fprintf(stderr, "%s handoff_receive() failed: %s\n", C_PREFIX_ERROR, "not a handoff socket");
+		return -1;
+	}
+
+	// A process of another version may lay its clients out differently, so only its listeners are trusted.
+	bool compatible = (version == HANDOFF_VERSION && record_size == HANDOFF_RECORD_SIZE);
+
+	if (!compatible)
+		fprintf(stderr, "%s Handoff version %u (%u bytes per record) doesn't match version %d (%d bytes per record), taking over the listeners only.\n",
+				C_PREFIX_WARNING, version, record_size, HANDOFF_VERSION, HANDOFF_RECORD_SIZE);
+
+	while (true)
+	{
+		if (handoff_receive_record(sock, record, record_size, &fd) < 0)
+			return -1;
+
+		pos = record;
+		uint32_t kind = handoff_get_u32(&pos);
+
+		if (!compatible && (kind == HANDOFF_STATS || kind == HANDOFF_CLIENT))
+		{
+			// The old process keeps the clients it couldn't hand off, and drains them.
+			if (fd >= 0)
+				close(fd);
+
+			continue;
+		}
+
+		switch (kind)
+		{
+			case HANDOFF_STATS:
+			{
+				client_t stats;
+
+				handoff_decode_client(record, &stats);
+
+				client_count = stats.id;
+				total_bytes_received = stats.bytes_received;
+				total_bytes_sent = stats.bytes_sent;
+				break;
+			}
+
+			case HANDOFF_LISTENER:
+			{
+				if (fd < 0)
+					break;
+
+				// The file descriptors changed, so the listeners are told apart by their address. A listener that's
+				// no longer in SERVER_LISTENERS is still taken over, without limits.
+				const listener_t *listener = listener_find(fd);
+
+				addListener(reactor, fd, (listener != NULL ? listener->handler : server_handler));
+				attach_listener_limit(reactor, fd, listener);
+
+				listeners++;
+				break;
+			}
+
+			case HANDOFF_CLIENT:
+			{
+				if (fd < 0)
+					break;
+
+				client_t_ptr client = (client_t_ptr)malloc(sizeof(client_t));
+
+				if (client == NULL)
+				{
+					fprintf(stderr, "%s malloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+					close(fd);
+					break;
+				}
+
+				// Whoever was writing to the client is gone with the old process, and so is its replay.
+				handoff_decode_client(record, client);
+
+				// A replay may have left the socket non-blocking.
+				if (!SERVER_COROUTINES && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)
+					fprintf(stderr, "%s fcntl() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+				if (SERVER_COROUTINES)
+				{
+					if (co_spawn(reactor, fd, client_coroutine, NULL) < 0)
+					{
+						free(client);
+						close(fd);
+						break;
+					}
+				}
+
+				else
+					addFd(reactor, fd, client_handler);
+
+				setFdContext(reactor, fd, client);
+
+				active_clients++;
+				clients++;
+				break;
+			}
+
+			case HANDOFF_END:
+			{
+				fprintf(stdout, "%s Took over %d listeners and %d clients.\n", C_PREFIX_INFO, listeners, clients);
+				*took_clients = compatible;
+
+				// The clients were never accepted here, so they weren't counted against SERVER_MAX_CLIENTS yet.
+				admission_check(reactor, active_clients);
+				return listeners;
+			}
+
+			default:
+			{
+				fprintf(stderr, "%s Unknown handoff record %u, ignoring.\n", C_PREFIX_WARNING, kind);
+
+				if (fd >= 0)
+					close(fd);
+
+				break;
+			}
+		}
+	}
+}
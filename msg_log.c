@@ -0,0 +1,688 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Needed for O_CLOEXEC.
+#define _GNU_SOURCE
+
+#include "msg_log.h"
+#include "coroutine.h"
+#include "shm_ring.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The total number of bytes sent to clients in the server's lifetime.
+extern uint64_t total_bytes_sent;
+
+/*
+ * @brief A single log segment - a data file with the payloads, and a record table, both memory-mapped.
+*/
+typedef struct _log_segment
+{
+	// The segment number, part of its file names.
+	uint32_t id;
+
+	// The data file, used as the source of sendfile().
+	int data_fd;
+
+	// The mapped data file.
+	char *data;
+
+	// The record table file.
+	int records_fd;
+
+	// The mapped record table.
+	log_record_t_ptr records;
+
+	// The number of records in the segment.
+	uint32_t count;
+
+	// The number of bytes used in the data file.
+	uint32_t used;
+} log_segment_t, *log_segment_t_ptr;
+
+/*
+ * @brief An entry of the sparse timestamp index.
+*/
+typedef struct _log_index_entry
+{
+	// The timestamp of the indexed record.
+	uint64_t timestamp;
+
+	// The segment number of the indexed record.
+	uint32_t segment;
+
+	// The position of the indexed record in its segment.
+	uint32_t record;
+} log_index_entry_t, *log_index_entry_t_ptr;
+
+// The directory of the log segments.
+static char log_dir[256] = { 0 };
+
+// The segments of the current run, from the oldest to the newest (the one being written).
+static log_segment_t segments[LOG_MAX_SEGMENTS];
+
+// The number of segments of the current run that are still kept.
+static size_t segments_count = 0;
+
+// The sparse timestamp index, one entry every LOG_INDEX_INTERVAL records.
+static log_index_entry_t_ptr index_entries = NULL;
+
+// The number of entries in the sparse index.
+static size_t index_count = 0;
+
+// The number of entries allocated for the sparse index.
+static size_t index_capacity = 0;
+
+// The timestamp of the last record, so timestamps never go backwards.
+static uint64_t last_timestamp = 0;
+
+/*
+ * @brief Build the path of a segment file.
+ * @param path The buffer to fill.
+ * @param size The size of the buffer.
+ * @param id The segment number.
+ * @param ext The file extension - "data" or "records".
+*/
+static void log_segment_path(char *path, size_t size, uint32_t id, const char *ext) {
+	snprintf(path, size, "%s/segment-%08u.%s", log_dir, id, ext);
+}
+
+/*
+ * @brief Create and map a segment file.
+ * @param id The segment number.
+ * @param ext The file extension.
+ * @param size The size of the file.
+ * @param fd Filled with the file descriptor of the file.
+ * @return The mapping on success, NULL otherwise.
+*/
+static void *log_segment_map(uint32_t id, const char *ext, size_t size, int *fd) {
+	char path[512];
+
+	log_segment_path(path, sizeof(path), id, ext);
+
+	if ((*fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	{
+		fprintf(stderr, "%s open(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(*fd, size) < 0)
+	{
+		fprintf(stderr, "%s ftruncate(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(errno));
+		close(*fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s mmap(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(errno));
+		close(*fd);
+		return NULL;
+	}
+
+	return map;
+}
+
+/*
+ * @brief Unmap and close a segment, and trim its data file to the used size.
+ * @param segment The segment.
+*/
+static void log_segment_close(log_segment_t_ptr segment) {
+	if (segment->data != NULL)
+		munmap(segment->data, LOG_SEGMENT_SIZE);
+
+	if (segment->records != NULL)
+		munmap(segment->records, LOG_SEGMENT_RECORDS * sizeof(log_record_t));
+
+	if (segment->data_fd >= 0)
+	{
+		if (ftruncate(segment->data_fd, segment->used) < 0)
+			fprintf(stderr, "%s ftruncate() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+		close(segment->data_fd);
+	}
+
+	if (segment->records_fd >= 0)
+	{
+		if (ftruncate(segment->records_fd, segment->count * sizeof(log_record_t)) < 0)
+			fprintf(stderr, "%s ftruncate() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+		close(segment->records_fd);
+	}
+
+	memset(segment, 0, sizeof(log_segment_t));
+	segment->data_fd = -1;
+	segment->records_fd = -1;
+}
+
+/*
+ * @brief Start a new segment, dropping the oldest one if too many are kept.
+ * @param id The segment number.
+ * @return 0 on success, -1 otherwise.
+*/
+static int log_segment_start(uint32_t id) {
+	if (segments_count == LOG_MAX_SEGMENTS)
+	{
+		char path[512];
+		uint32_t dropped = segments[0].id;
+		size_t keep = 0;
+
+		log_segment_close(&segments[0]);
+
+		log_segment_path(path, sizeof(path), dropped, "data");
+		unlink(path);
+		log_segment_path(path, sizeof(path), dropped, "records");
+		unlink(path);
+
+		memmove(segments, segments + 1, (LOG_MAX_SEGMENTS - 1) * sizeof(log_segment_t));
+		segments_count--;
+
+		// The index is ordered by time, so the entries of the oldest segment are all at its start.
+		while (keep < index_count && index_entries[keep].segment == dropped)
+			keep++;
+
+		memmove(index_entries, index_entries + keep, (index_count - keep) * sizeof(log_index_entry_t));
+		index_count -= keep;
+	}
+
+	log_segment_t_ptr segment = &segments[segments_count];
+
+	memset(segment, 0, sizeof(log_segment_t));
+	segment->id = id;
+	segment->data_fd = -1;
+	segment->records_fd = -1;
+
+	if ((segment->data = (char *)log_segment_map(id, "data", LOG_SEGMENT_SIZE, &segment->data_fd)) == NULL ||
+		(segment->records = (log_record_t_ptr)log_segment_map(id, "records", LOG_SEGMENT_RECORDS * sizeof(log_record_t), &segment->records_fd)) == NULL)
+	{
+		log_segment_close(segment);
+		return -1;
+	}
+
+	segments_count++;
+
+	return 0;
+}
+
+int log_open(const char *dir) {
+	uint32_t next_id = 0, id = 0;
+
+	if (dir == NULL || strlen(dir) >= sizeof(log_dir))
+	{
+		fprintf(stderr, "%s log_open() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return -1;
+	}
+
+	strncpy(log_dir, dir, sizeof(log_dir) - 1);
+
+	if (mkdir(log_dir, 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "%s mkdir(%s) failed: %s\n", C_PREFIX_ERROR, log_dir, strerror(errno));
+		return -1;
+	}
+
+	// Keep the segments of previous runs, and continue the numbering after them.
+	DIR *d = opendir(log_dir);
+
+	if (d != NULL)
+	{
+		struct dirent *entry = NULL;
+
+		while ((entry = readdir(d)) != NULL)
+		{
+			if (sscanf(entry->d_name, "segment-%u.", &id) == 1 && id >= next_id)
+				next_id = id + 1;
+		}
+
+		closedir(d);
+	}
+
+	if (log_segment_start(next_id) < 0)
+		return -1;
+
+	fprintf(stdout, "%s Logging messages to \033[0;32m%s\033[0;37m, starting at segment %u.\n", C_PREFIX_INFO, log_dir, next_id);
+
+	return 0;
+}
+
+void log_close() {
+	for (size_t i = 0; i < segments_count; ++i)
+		log_segment_close(&segments[i]);
+
+	segments_count = 0;
+
+	free(index_entries);
+	index_entries = NULL;
+	index_count = 0;
+	index_capacity = 0;
+}
+
+void log_append(uint32_t sender, const char *msg, size_t len) {
+	struct timespec ts;
+
+	if (segments_count == 0 || len > LOG_SEGMENT_SIZE)
+		return;
+
+	log_segment_t_ptr segment = &segments[segments_count - 1];
+
+	// Rotate when the data or the record table of the current segment is full.
+	if (segment->count == LOG_SEGMENT_RECORDS || LOG_SEGMENT_SIZE - segment->used < len)
+	{
+		uint32_t id = segment->id + 1;
+
+		if (ftruncate(segment->data_fd, segment->used) < 0)
+			fprintf(stderr, "%s ftruncate() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+		if (log_segment_start(id) < 0)
+			return;
+
+		segment = &segments[segments_count - 1];
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint64_t timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+
+	if (timestamp < last_timestamp)
+		timestamp = last_timestamp;
+
+	last_timestamp = timestamp;
+
+	if (segment->count % LOG_INDEX_INTERVAL == 0)
+	{
+		if (index_count == index_capacity)
+		{
+			size_t capacity = (index_capacity == 0 ? 256 : index_capacity * 2);
+			log_index_entry_t_ptr entries = (log_index_entry_t_ptr)realloc(index_entries, capacity * sizeof(log_index_entry_t));
+
+			if (entries == NULL)
+			{
+				fprintf(stderr, "%s realloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+				return;
+			}
+
+			index_entries = entries;
+			index_capacity = capacity;
+		}
+
+		index_entries[index_count].timestamp = timestamp;
+		index_entries[index_count].segment = segment->id;
+		index_entries[index_count].record = segment->count;
+		index_count++;
+	}
+
+	memcpy(segment->data + segment->used, msg, len);
+
+	log_record_t_ptr record = &segment->records[segment->count];
+
+	record->timestamp = timestamp;
+	record->sender = sender;
+	record->offset = segment->used;
+	record->len = len;
+
+	segment->used += len;
+	segment->count++;
+}
+
+/*
+ * @brief Copy the records from a given one up to the newest one into the ring of a shared-memory client.
+ * @param client The per-connection state of the client.
+ * @param seg The position of the first segment in the segments array.
+ * @param record The position of the first record in its segment.
+ * @return The number of records sent.
+*/
+static uint32_t log_replay_shm(client_t_ptr client, size_t seg, uint32_t record) {
+	uint32_t sent = 0;
+
+	for (; seg < segments_count; ++seg, record = 0)
+	{
+		log_segment_t_ptr segment = &segments[seg];
+
+		for (; record < segment->count; ++record, ++sent)
+		{
+			if (shm_session_send(client->shm, segment->data + segment->records[record].offset, segment->records[record].len))
+			{
+				total_bytes_sent += segment->records[record].len;
+				client->bytes_sent += segment->records[record].len;
+			}
+		}
+	}
+
+	return sent;
+}
+
+/*
+ * @brief Check whether a record was appended after the replay was requested.
+ * @param cursor The replay.
+ * @param id The ID of the segment of the record.
+ * @param record The position of the record in its segment.
+ * @return true if it was, false otherwise.
+*/
+static bool log_cursor_past_end(log_cursor_t_ptr cursor, uint32_t id, uint32_t record) {
+	return (id > cursor->end_segment || (id == cursor->end_segment && record >= cursor->end_record));
+}
+
+/*
+ * @brief Send the next step of a replay, at most LOG_REPLAY_STEP bytes.
+ * @param fd The file descriptor of the client, non-blocking.
+ * @param client The per-connection state of the client.
+ * @return 1 if the replay caught up with the log, 0 if there's more to send, -1 if sending failed.
+ * @note The records that were relayed while the replay was in progress are sent too, except the client's own,
+ * 			so the client doesn't miss any message, and gets each one once.
+*/
+static int log_replay_step(int fd, client_t_ptr client) {
+	log_cursor_t_ptr cursor = &client->replay;
+	size_t budget = LOG_REPLAY_STEP;
+
+	while (budget > 0)
+	{
+		size_t seg = 0;
+
+		// Segments rotate while the replay is in progress, so the segment is found again by its ID every time.
+		while (seg < segments_count && segments[seg].id != cursor->segment)
+			seg++;
+
+		if (seg == segments_count)
+		{
+			if (segments_count == 0 || segments[0].id < cursor->segment)
+				return 1;
+
+			// The segment was deleted before the client got to it, so it goes on from the oldest segment kept.
+			fprintf(stderr, "%s Client %u fell behind the log, some messages were skipped.\n", C_PREFIX_WARNING, client->id);
+
+			cursor->segment = segments[0].id;
+			cursor->record = 0;
+			cursor->partial = 0;
+			seg = 0;
+		}
+
+		log_segment_t_ptr segment = &segments[seg];
+
+		if (cursor->record >= segment->count)
+		{
+			if (seg + 1 == segments_count)
+				return 1;
+
+			cursor->segment = segments[seg + 1].id;
+			cursor->record = 0;
+			cursor->partial = 0;
+			continue;
+		}
+
+		log_record_t_ptr records = segment->records;
+
+		if (cursor->partial == 0 && log_cursor_past_end(cursor, segment->id, cursor->record) && records[cursor->record].sender == client->id)
+		{
+			cursor->record++;
+			continue;
+		}
+
+		// The payloads are back-to-back, so a run of records goes out straight from the page cache, with a single call.
+		uint32_t last = cursor->record;
+		size_t len = records[last].len - cursor->partial;
+
+		while (len < budget && last + 1 < segment->count && !(log_cursor_past_end(cursor, segment->id, last + 1) && records[last + 1].sender == client->id))
+			len += records[++last].len;
+
+		if (len > budget)
+			len = budget;
+
+		off_t offset = records[cursor->record].offset + cursor->partial;
+		ssize_t bytes_write = sendfile(fd, segment->data_fd, &offset, len);
+
+		if (bytes_write < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		if (bytes_write <= 0)
+		{
+			fprintf(stderr, "%s sendfile() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+			return -1;
+		}
+
+		budget -= (size_t)bytes_write;
+		total_bytes_sent += (uint64_t)bytes_write;
+		client->bytes_sent += (uint64_t)bytes_write;
+
+		// Move past the records that were sent whole.
+		size_t done = cursor->partial + (size_t)bytes_write;
+
+		while (cursor->record <= last && done >= records[cursor->record].len)
+		{
+			done -= records[cursor->record].len;
+			cursor->record++;
+			cursor->sent++;
+		}
+
+		cursor->partial = (uint32_t)done;
+
+		// The client has no room for more.
+		if ((size_t)bytes_write < len)
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Send a replay to a client until it has no room for more, or it's done.
+ * @param react The reactor.
+ * @param fd The file descriptor of the client.
+ * @param client The per-connection state of the client.
+ * @note A coroutine waits for room in the client, the reactor thread can't - it's called again on POLLOUT instead.
+*/
+static void log_replay_run(void *react, int fd, client_t_ptr client) {
+	log_cursor_t_ptr cursor = &client->replay;
+	int ret = 0;
+
+	while ((ret = log_replay_step(fd, client)) == 0)
+	{
+		if (cursor->polling)
+			return;
+
+		if (co_wait(fd, POLLOUT) < 0)
+		{
+			if (errno != EPERM)
+				break;
+
+			cursor->polling = true;
+			setFdEvents(react, fd, POLLIN | POLLOUT);
+			return;
+		}
+	}
+
+	if (cursor->polling)
+		setFdEvents(react, fd, POLLIN);
+
+	if (cursor->nonblock && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)
+		fprintf(stderr, "%s fcntl() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+	fprintf(stdout, "%s Replayed %u messages to client %u.\n", C_PREFIX_INFO, cursor->sent, client->id);
+
+	memset(cursor, 0, sizeof(log_cursor_t));
+}
+
+/*
+ * @brief Find the first record relayed at or after a given time.
+ * @param timestamp The time, in nanoseconds since the epoch.
+ * @param seg Filled with the position of the segment in the segments array.
+ * @param record Filled with the position of the record in its segment.
+ * @note Binary searches the sparse index, then scans at most LOG_INDEX_INTERVAL records.
+*/
+static void log_find(uint64_t timestamp, size_t *seg, uint32_t *record) {
+	size_t low = 0, high = index_count;
+
+	*seg = 0;
+	*record = 0;
+
+	// Find the last index entry before the timestamp.
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+
+		if (index_entries[mid].timestamp < timestamp)
+			low = mid + 1;
+
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		return;
+
+	for (size_t i = 0; i < segments_count; ++i)
+	{
+		if (segments[i].id == index_entries[low - 1].segment)
+		{
+			*seg = i;
+			*record = index_entries[low - 1].record;
+			break;
+		}
+	}
+
+	while (*seg < segments_count)
+	{
+		while (*record < segments[*seg].count && segments[*seg].records[*record].timestamp < timestamp)
+			(*record)++;
+
+		if (*record < segments[*seg].count)
+			return;
+
+		(*seg)++;
+		*record = 0;
+	}
+}
+
+/*
+ * @brief Find the record a given number of records before the newest one.
+ * @param count The number of records.
+ * @param seg Filled with the position of the segment in the segments array.
+ * @param record Filled with the position of the record in its segment.
+*/
+static void log_find_last(uint32_t count, size_t *seg, uint32_t *record) {
+	// Walk back from the newest segment, until enough records are covered.
+	*seg = segments_count - 1;
+	*record = segments[*seg].count;
+
+	while (count > *record && *seg > 0)
+	{
+		count -= *record;
+		*record = segments[--(*seg)].count;
+	}
+
+	*record = (count > *record ? 0 : *record - count);
+}
+
+/*
+ * @brief Check whether the rest of a request is empty, or just a newline.
+ * @param rest The rest of the request.
+ * @return true if it is, false otherwise.
+*/
+static bool log_request_end(const char *rest) {
+	while (*rest == ' ' || *rest == '\r' || *rest == '\n')
+		rest++;
+
+	return (*rest == '\0');
+}
+
+bool log_handle_request(void *react, int fd, client_t_ptr client, const char *buf) {
+	unsigned int count = 0;
+	double since = 0;
+	size_t seg = 0, first_seg = 0;
+	uint32_t record = 0, first_record = 0;
+	int end = 0;
+
+	if (segments_count == 0 || client == NULL || buf == NULL || *buf != '/')
+		return false;
+
+	if (sscanf(buf, "/last %u%n", &count, &end) == 1 && log_request_end(buf + end))
+		log_find_last((count > LOG_REPLAY_MAX ? LOG_REPLAY_MAX : count), &seg, &record);
+
+	else if (sscanf(buf, "/since %lf%n", &since, &end) == 1 && log_request_end(buf + end) && since >= 0)
+	{
+		log_find((uint64_t)(since * 1000000000.0), &seg, &record);
+
+		// At most LOG_REPLAY_MAX records, the newest ones.
+		log_find_last(LOG_REPLAY_MAX, &first_seg, &first_record);
+
+		if (seg < first_seg || (seg == first_seg && record < first_record))
+		{
+			seg = first_seg;
+			record = first_record;
+		}
+	}
+
+	else
+		return false;
+
+	// Shared-memory clients get a copy through their ring, it never blocks.
+	if (client->shm != NULL)
+	{
+		uint32_t sent = log_replay_shm(client, seg, record);
+
+		fprintf(stdout, "%s Replayed %u messages to client %u.\n", C_PREFIX_INFO, sent, client->id);
+		return true;
+	}
+
+	if (client->replay.active)
+	{
+		fprintf(stderr, "%s Client %u asked for a replay in the middle of another one, ignored.\n", C_PREFIX_WARNING, client->id);
+		return true;
+	}
+
+	// A coroutine that's in the middle of relaying a message to the client finishes it first.
+	while (client->relay_busy && co_wait(fd, POLLOUT) == 0)
+		;
+
+	log_cursor_t_ptr cursor = &client->replay;
+	int flags = fcntl(fd, F_GETFL);
+
+	// A step never blocks the reactor - the socket is non-blocking for the duration of the replay.
+	if (flags < 0 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+	{
+		fprintf(stderr, "%s fcntl() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return true;
+	}
+
+	memset(cursor, 0, sizeof(log_cursor_t));
+
+	cursor->active = true;
+	cursor->nonblock = !(flags & O_NONBLOCK);
+	cursor->segment = (seg < segments_count ? segments[seg].id : segments[segments_count - 1].id);
+	cursor->record = (seg < segments_count ? record : segments[segments_count - 1].count);
+	cursor->end_segment = segments[segments_count - 1].id;
+	cursor->end_record = segments[segments_count - 1].count;
+
+	log_replay_run(react, fd, client);
+
+	return true;
+}
+
+void log_replay_continue(void *react, int fd, client_t_ptr client) {
+	if (client != NULL && client->replay.active)
+		log_replay_run(react, fd, client);
+}
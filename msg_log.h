@@ -0,0 +1,176 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MSG_LOG_H
+#define _MSG_LOG_H
+
+#include "reactor.h"
+#include <sys/types.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief Defines whether the server keeps a log of every relayed message.
+ * @note The default value is 1.
+ * @note A value of 1 means that every relayed message is appended to a memory-mapped log, and clients may ask
+ * 			for the messages they missed with "/last <count>" or "/since <unix time>".
+*/
+#define SERVER_LOG_MSGS		1
+
+/*
+ * @brief The directory in which the log segments are kept.
+ * @note The default directory is /tmp/react_server_log.
+*/
+#define LOG_DIR				"/tmp/react_server_log"
+
+/*
+ * @brief The size of the data file of a single log segment, in bytes.
+ * @note The default size is 16 MB.
+*/
+#define LOG_SEGMENT_SIZE	(16 << 20)
+
+/*
+ * @brief The maximum number of records in a single log segment.
+ * @note The default number is 65536 records.
+*/
+#define LOG_SEGMENT_RECORDS	65536
+
+/*
+ * @brief The number of segments kept on disk - older segments are deleted on rotation.
+ * @note The default number is 16 segments.
+*/
+#define LOG_MAX_SEGMENTS	16
+
+/*
+ * @brief The sparse timestamp index holds one entry every this many records.
+ * @note The default interval is 64 records.
+*/
+#define LOG_INDEX_INTERVAL	64
+
+/*
+ * @brief The maximum number of messages a single replay request may return.
+ * @note The default number is 10000 messages.
+ * @note A request for more gets the newest ones.
+*/
+#define LOG_REPLAY_MAX		10000
+
+/*
+ * @brief The maximum number of bytes a replay sends to a client at once, before the other clients are served.
+ * @note The default size is 64 KB.
+*/
+#define LOG_REPLAY_STEP		(64 << 10)
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief A single record in the record table of a log segment.
+*/
+typedef struct _log_record log_record_t, *log_record_t_ptr;
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief A single record in the record table of a log segment.
+ * @note The payloads of a segment are kept back-to-back in its data file, in the same order as
+ * 			the records, so any run of records can be sent with a single sendfile() call.
+*/
+struct _log_record
+{
+	/*
+	 * @brief The time the message was relayed, in nanoseconds since the epoch.
+	 * @note The timestamps never go backwards within a log, even if the clock does.
+	*/
+	uint64_t timestamp;
+
+	/*
+	 * @brief The reference ID of the sender.
+	*/
+	uint32_t sender;
+
+	/*
+	 * @brief The offset of the payload in the segment's data file.
+	*/
+	uint32_t offset;
+
+	/*
+	 * @brief The length of the payload, in bytes.
+	*/
+	uint32_t len;
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Open the message log, and start a new segment.
+ * @param dir The directory of the log segments, created if needed.
+ * @return 0 on success, -1 otherwise.
+ * @note Segments left by previous runs are kept on disk for auditing, but only the segments
+ * 			of the current run are served to clients.
+*/
+int log_open(const char *dir);
+
+/*
+ * @brief Close the message log, trimming the current segment to its used size.
+*/
+void log_close();
+
+/*
+ * @brief Append a relayed message to the log.
+ * @param sender The reference ID of the sender.
+ * @param msg The message, exactly as it was relayed.
+ * @param len The length of the message, in bytes.
+*/
+void log_append(uint32_t sender, const char *msg, size_t len);
+
+/*
+ * @brief Handle a replay request from a client - "/last <count>" or "/since <unix time>".
+ * @param react The reactor.
+ * @param fd The file descriptor of the client.
+ * @param client The per-connection state of the client.
+ * @param buf The message the client sent, null-terminated.
+ * @return true if the message was a replay request (and thus shouldn't be relayed), false otherwise.
+ * @note Only a message that is exactly a request (maybe followed by a newline) is one, see SERVER_RELAY.
+ * @note Socket clients get the messages straight from the segment files with sendfile(), at most LOG_REPLAY_STEP
+ * 			bytes at a time, and the rest whenever they have room for it - a coroutine waits for it, otherwise the
+ * 			replay goes on from log_replay_continue() on POLLOUT. Shared-memory clients get them through their ring.
+*/
+bool log_handle_request(void *react, int fd, client_t_ptr client, const char *buf);
+
+/*
+ * @brief Go on with the replay in progress to a client, if any.
+ * @param react The reactor.
+ * @param fd The file descriptor of the client.
+ * @param client The per-connection state of the client.
+ * @return void
+ * @note Called by the client's handler - while a replay is in progress, it's called on POLLOUT too.
+*/
+void log_replay_continue(void *react, int fd, client_t_ptr client);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "reactor.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+// The number of times clients were throttled, see react_server.c.
+extern uint64_t throttle_count;
+
+/*
+ * @brief Get the current time of the monotonic clock.
+ * @return The current time, in nanoseconds.
+*/
+static uint64_t bucket_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void attach_listener_limit(void *react, int fd, const listener_t *listener) {
+	listener_t_ptr copy = (listener_t_ptr)calloc(1, sizeof(listener_t));
+
+	if (copy == NULL)
+	{
+		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return;
+	}
+
+	// The node owns its context, and frees it when the listener is removed.
+	if (listener != NULL)
+		*copy = *listener;
+
+	setFdContext(react, fd, copy);
+}
+
+void bucket_init(token_bucket_t_ptr bucket, void *react, int listener_fd) {
+	listener_t_ptr listener = (listener_t_ptr)getFdContext(react, listener_fd);
+
+	memset(bucket, 0, sizeof(token_bucket_t));
+
+	if (listener != NULL)
+		bucket->limit = listener->limit;
+
+	// A new client starts with a full bucket.
+	bucket->bytes = (double)bucket->limit.bytes_per_sec * SERVER_RATE_BURST_MS / 1000.0;
+	bucket->msgs = (double)bucket->limit.msgs_per_sec * SERVER_RATE_BURST_MS / 1000.0;
+	bucket->last_refill = bucket_now();
+}
+
+uint64_t bucket_consume(client_t_ptr client, void *react, int fd, size_t bytes) {
+	if (client == NULL || (client->bucket.limit.bytes_per_sec == 0 && client->bucket.limit.msgs_per_sec == 0))
+		return 0;
+
+	token_bucket_t_ptr bucket = &client->bucket;
+	uint64_t now = bucket_now();
+	double elapsed = (double)(now - bucket->last_refill) / 1e9, wait = 0.0;
+
+	bucket->last_refill = now;
+
+	if (bucket->limit.bytes_per_sec > 0)
+	{
+		double capacity = (double)bucket->limit.bytes_per_sec * SERVER_RATE_BURST_MS / 1000.0;
+
+		bucket->bytes += elapsed * bucket->limit.bytes_per_sec;
+
+		if (bucket->bytes > capacity)
+			bucket->bytes = capacity;
+
+		bucket->bytes -= (double)bytes;
+
+		// The client owes bytes, it waits until they are paid back.
+		if (bucket->bytes < 0 && -bucket->bytes / bucket->limit.bytes_per_sec > wait)
+			wait = -bucket->bytes / bucket->limit.bytes_per_sec;
+	}
+
+	if (bucket->limit.msgs_per_sec > 0)
+	{
+		double capacity = (double)bucket->limit.msgs_per_sec * SERVER_RATE_BURST_MS / 1000.0;
+
+		bucket->msgs += elapsed * bucket->limit.msgs_per_sec;
+
+		if (bucket->msgs > capacity)
+			bucket->msgs = capacity;
+
+		bucket->msgs -= 1.0;
+
+		if (bucket->msgs < 0 && -bucket->msgs / bucket->limit.msgs_per_sec > wait)
+			wait = -bucket->msgs / bucket->limit.msgs_per_sec;
+	}
+
+	if (wait <= 0.0)
+		return 0;
+
+	uint64_t usec = (uint64_t)(wait * 1e6) + 1;
+
+	// Stop reading from the client until its bucket is refilled - the kernel pushes back on it meanwhile.
+	pauseFd(react, fd, usec);
+
+	client->throttled++;
+	throttle_count++;
+
+	return usec;
+}
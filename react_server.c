@@ -17,18 +17,33 @@
 */
 
 #include "reactor.h"
+#include "coroutine.h"
+#include "capture.h"
+#include "msg_log.h"
+#include "shm_ring.h"
+#include "udp_relay.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 // The reactor pointer.
 void* reactor = NULL;
 
+// The listeners of the server, see SERVER_LISTENERS.
+const listener_t server_listeners[] = SERVER_LISTENERS;
+
+// The number of listeners in SERVER_LISTENERS.
+#define SERVER_LISTENERS_COUNT	(sizeof(server_listeners) / sizeof(server_listeners[0]))
+
 // The number of clients connected to the server in its lifetime.
 uint32_t client_count = 0;
 
@@ -38,46 +53,153 @@ uint64_t total_bytes_received = 0;
 // The total number of bytes sent to clients in the server's lifetime.
 uint64_t total_bytes_sent = 0;
 
-int main(void) {
-	struct sockaddr_in server_addr = {
-		.sin_family = AF_INET,
-		.sin_port = htons(SERVER_PORT),
-		.sin_addr.s_addr = INADDR_ANY
-	};
+// The number of clients currently connected to the server.
+uint32_t active_clients = 0;
 
-	int server_fd = -1, reuse = 1;
+// The number of times clients were throttled for going over their rate limits.
+uint64_t throttle_count = 0;
 
-	fprintf(stdout, "%s", C_INFO_LICENSE);
+// A file descriptor kept in reserve, to accept and close connections when the process runs out of them.
+int reserve_fd = -1;
 
-	signal(SIGINT, signal_handler);
+// Whether the listeners are paused because the server is full.
+bool admission_paused = false;
 
-	fprintf(stdout, "%s Starting server...\n", C_PREFIX_INFO);
+// The number of clients at which paused listeners are resumed.
+uint32_t admission_resume = 0;
+
+// Whether the listening sockets were handed off to a new process (hot restart).
+bool handed_off = false;
+
+// Whether the server is draining its clients after a hot restart.
+bool draining = false;
+
+// The command line arguments, used to exec the new process on a hot restart.
+char **server_argv = NULL;
+
+// The path of the server binary, resolved at startup, so a hot restart execs whatever binary is there by then.
+char server_exe_path[PATH_MAX] = { 0 };
+
+// Set by SIGINT and SIGALRM, handled by run_server() once the reactor stopped.
+volatile sig_atomic_t shutdown_requested = 0;
 
-	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+// Set by SIGUSR2, handled by run_server() once the reactor stopped.
+volatile sig_atomic_t restart_requested = 0;
+
+// A self-pipe, written by the signal handlers to stop the reactor.
+int signal_pipe[2] = { -1, -1 };
+
+int main(int argc, char *argv[]) {
+	int listeners[SERVER_LISTENERS_COUNT];
+	const listener_t *listener_configs[SERVER_LISTENERS_COUNT];
+	size_t listeners_count = 0;
+	char *handoff_env = getenv(SERVER_HANDOFF_ENV);
+
+	(void)argc;
+	server_argv = argv;
+
+	// Once a deploy renames a new binary over this one, /proc/self/exe points at the deleted file, so resolve the path now.
+	if (strchr(argv[0], '/') == NULL || realpath(argv[0], server_exe_path) == NULL)
 	{
-		fprintf(stderr, "%s socket() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		return EXIT_FAILURE;
+		ssize_t len = readlink("/proc/self/exe", server_exe_path, sizeof(server_exe_path) - 1);
+
+		server_exe_path[(len < 0 ? 0 : len)] = '\0';
 	}
 
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
+	fprintf(stdout, "%s", C_INFO_LICENSE);
+
+	// Closed on exec, like the reserved file descriptor below.
+	if (pipe(signal_pipe) < 0)
 	{
-		fprintf(stderr, "%s setsockopt(SO_REUSEADDR) failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		close(server_fd);
+		fprintf(stderr, "%s pipe() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
-	if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+	for (int i = 0; i < 2; ++i)
 	{
-		fprintf(stderr, "%s bind() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		close(server_fd);
-		return EXIT_FAILURE;
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
 	}
 
-	if (listen(server_fd, MAX_QUEUE) < 0)
+	signal(SIGINT, signal_handler);
+	signal(SIGALRM, signal_handler);
+	signal(SIGUSR2, restart_handler);
+
+	// sendfile() has no MSG_NOSIGNAL, and a client may close its end in the middle of a replay.
+	signal(SIGPIPE, SIG_IGN);
+
+	// Closed on exec, so it doesn't leak into the new process on a hot restart.
+	if ((reserve_fd = open("/dev/null", O_RDONLY)) < 0 || fcntl(reserve_fd, F_SETFD, FD_CLOEXEC) < 0)
+		fprintf(stderr, "%s Can't reserve a file descriptor: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+	if (SERVER_CAPTURE && capture_open() < 0)
+		fprintf(stderr, "%s Traffic capture is unavailable, continuing without it.\n", C_PREFIX_WARNING);
+
+	// The log is an extra, the server works the same without it.
+	if (SERVER_LOG_MSGS && log_open(LOG_DIR) < 0)
+		fprintf(stderr, "%s Message log is unavailable, continuing without it.\n", C_PREFIX_WARNING);
+
+	// Hot restart - take over the listeners (and clients) of the old process instead of binding.
+	if (handoff_env != NULL)
 	{
-		fprintf(stderr, "%s listen() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		close(server_fd);
-		return EXIT_FAILURE;
+		int handoff_fd = atoi(handoff_env);
+		bool took_clients = false;
+
+		unsetenv(SERVER_HANDOFF_ENV);
+
+		fprintf(stdout, "%s Starting server from a hot restart...\n", C_PREFIX_INFO);
+
+		if ((reactor = createReactor()) == NULL)
+		{
+			fprintf(stderr, "%s createReactor() failed: %s\n", C_PREFIX_ERROR, strerror(ENOSPC));
+			close(handoff_fd);
+			return EXIT_FAILURE;
+		}
+
+		if (handoff_receive(handoff_fd, &took_clients) <= 0)
+		{
+			fprintf(stderr, "%s Hot restart failed, no listeners were received.\n", C_PREFIX_ERROR);
+			close(handoff_fd);
+			handed_off = true;
+			server_shutdown();
+		}
+
+		// Let the old process know we took over, so it can exit, or keep draining the clients we didn't take.
+		char ack = (took_clients ? 1 : 0);
+
+		if (write(handoff_fd, &ack, 1) != 1)
+			fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+		close(handoff_fd);
+
+		fprintf(stdout, "%s Server took over successfully.\n", C_PREFIX_INFO);
+
+		if (SERVER_UDP_RELAY && udp_relay_open(reactor) < 0)
+			fprintf(stderr, "%s UDP relay is unavailable, continuing without it.\n", C_PREFIX_WARNING);
+
+		run_server();
+	}
+
+	fprintf(stdout, "%s Starting server...\n", C_PREFIX_INFO);
+
+	for (size_t i = 0; i < SERVER_LISTENERS_COUNT; ++i)
+	{
+		const listener_t *listener = &server_listeners[i];
+
+		if (!listener->enabled)
+			continue;
+
+		if ((listeners[listeners_count] = create_listener(listener)) == -1)
+		{
+			// Only the first listener is required, the server can still serve its clients without the others.
+			if (i == 0)
+				return EXIT_FAILURE;
+
+			fprintf(stderr, "%s %s listener is unavailable, continuing without it.\n", C_PREFIX_WARNING, listener->name);
+			continue;
+		}
+
+		listener_configs[listeners_count++] = listener;
 	}
 
 	fprintf(stdout, "%s Server started successfully.\n", C_PREFIX_INFO);
@@ -86,40 +208,291 @@ int main(void) {
 	fprintf(stdout, "%s Server is set to %s.\n", C_PREFIX_INFO, (SERVER_RELAY ? "\033[0;32mrelay messages\033[0;37m" : "\033[0;31mnot relay messages\033[0;37m"));
 	fprintf(stdout, "%s Server is set to %s.\n", C_PREFIX_INFO, (SERVER_PRINT_MSGS ? "\033[0;32mprint messages\033[0;37m" : "\033[0;31mnot print messages\033[0;37m"));
 
-	fprintf(stdout, "%s Server listening on port \033[0;32m%d\033[0;37m.\n", C_PREFIX_INFO, SERVER_PORT);
-
 	reactor = createReactor();
 
 	if (reactor == NULL)
 	{
 		fprintf(stderr, "%s createReactor() failed: %s\n", C_PREFIX_ERROR, strerror(ENOSPC));
-		close(server_fd);
+
+		for (size_t i = 0; i < listeners_count; ++i)
+		{
+			close(listeners[i]);
+
+			if (listener_configs[i]->family == AF_UNIX)
+				unlink(listener_configs[i]->address);
+		}
+
 		return EXIT_FAILURE;
 	}
 
-	fprintf(stdout, "%s Adding server socket to reactor...\n", C_PREFIX_INFO);
+	fprintf(stdout, "%s Adding server sockets to reactor...\n", C_PREFIX_INFO);
 
-	addFd(reactor, server_fd, server_handler);
+	for (size_t i = 0; i < listeners_count; ++i)
+	{
+		addListener(reactor, listeners[i], listener_configs[i]->handler);
 
-	if (((reactor_t_ptr)reactor)->head == NULL)
+		// Listeners are always appended, so a failed addListener() leaves the list shorter.
+		size_t count = 0;
+
+		for (reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head; curr != NULL; curr = curr->next)
+			count++;
+
+		if (count != i + 1)
+		{
+			fprintf(stderr, "%s addListener() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+			for (size_t j = i; j < listeners_count; ++j)
+				close(listeners[j]);
+
+			server_shutdown();
+		}
+
+		attach_listener_limit(reactor, listeners[i], listener_configs[i]);
+	}
+
+	fprintf(stdout, "%s Server sockets added to reactor successfully.\n", C_PREFIX_INFO);
+
+	// Without the UDP relay, messages are relayed over TCP as usual.
+	if (SERVER_UDP_RELAY && udp_relay_open(reactor) < 0)
+		fprintf(stderr, "%s UDP relay is unavailable, continuing without it.\n", C_PREFIX_WARNING);
+
+	run_server();
+
+	return EXIT_SUCCESS;
+}
+
+int create_listener(const listener_t *listener) {
+	struct sockaddr_in server_addr4 = {
+		.sin_family = AF_INET,
+		.sin_port = htons(SERVER_PORT),
+		.sin_addr.s_addr = INADDR_ANY
+	};
+
+	struct sockaddr_in6 server_addr6 = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(SERVER_PORT),
+		.sin6_addr = IN6ADDR_ANY_INIT
+	};
+
+	struct sockaddr_un server_addrun = {
+		.sun_family = AF_UNIX
+	};
+
+	struct sockaddr *addr = NULL;
+	socklen_t addr_len = 0;
+	int server_fd = -1, reuse = 1, family = listener->family;
+	const char *name = listener->name, *path = listener->address;
+
+	switch (family)
 	{
-		fprintf(stderr, "%s addFd() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		case AF_INET:
+			if (path != NULL && inet_pton(AF_INET, path, &server_addr4.sin_addr) != 1)
+			{
+				fprintf(stderr, "%s inet_pton(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(EINVAL));
+				return -1;
+			}
+
+			addr = (struct sockaddr *)&server_addr4;
+			addr_len = sizeof(server_addr4);
+			break;
+
+		case AF_INET6:
+			if (path != NULL && inet_pton(AF_INET6, path, &server_addr6.sin6_addr) != 1)
+			{
+				fprintf(stderr, "%s inet_pton(%s) failed: %s\n", C_PREFIX_ERROR, path, strerror(EINVAL));
+				return -1;
+			}
+
+			addr = (struct sockaddr *)&server_addr6;
+			addr_len = sizeof(server_addr6);
+			break;
+
+		case AF_UNIX:
+			if (path == NULL)
+			{
+				fprintf(stderr, "%s create_listener() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+				return -1;
+			}
+
+			strncpy(server_addrun.sun_path, path, sizeof(server_addrun.sun_path) - 1);
+			addr = (struct sockaddr *)&server_addrun;
+			addr_len = sizeof(server_addrun);
+
+			// Remove a stale socket file left by a previous run, otherwise bind() fails.
+			unlink(path);
+			break;
+
+		default:
+			fprintf(stderr, "%s create_listener() failed: %s\n", C_PREFIX_ERROR, strerror(EAFNOSUPPORT));
+			return -1;
+	}
+
+	if ((server_fd = socket(family, SOCK_STREAM, 0)) == -1)
+	{
+		fprintf(stderr, "%s socket(%s) failed: %s\n", C_PREFIX_ERROR, name, strerror(errno));
+		return -1;
+	}
+
+	if (family != AF_UNIX && setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
+	{
+		fprintf(stderr, "%s setsockopt(SO_REUSEADDR) failed: %s\n", C_PREFIX_ERROR, strerror(errno));
 		close(server_fd);
-		free(reactor);
-		return EXIT_FAILURE;
+		return -1;
 	}
 
-	fprintf(stdout, "%s Server socket added to reactor successfully.\n", C_PREFIX_INFO);
+	// Keep the IPv6 socket IPv6-only, so it doesn't collide with the IPv4 socket on the same port.
+	if (family == AF_INET6 && setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &reuse, sizeof(int)) < 0)
+	{
+		fprintf(stderr, "%s setsockopt(IPV6_V6ONLY) failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(server_fd);
+		return -1;
+	}
 
-	startReactor(reactor);
-	WaitFor(reactor);
+	if (bind(server_fd, addr, addr_len) < 0)
+	{
+		fprintf(stderr, "%s bind(%s) failed: %s\n", C_PREFIX_ERROR, name, strerror(errno));
+		close(server_fd);
+		return -1;
+	}
 
-	signal_handler();
+	if (listen(server_fd, MAX_QUEUE) < 0)
+	{
+		fprintf(stderr, "%s listen(%s) failed: %s\n", C_PREFIX_ERROR, name, strerror(errno));
+		close(server_fd);
+		return -1;
+	}
 
-	return EXIT_SUCCESS;
+	if (family == AF_UNIX)
+		fprintf(stdout, "%s Server listening on %s socket \033[0;32m%s\033[0;37m.\n", C_PREFIX_INFO, name, path);
+
+	else
+		fprintf(stdout, "%s Server listening on %s port \033[0;32m%d\033[0;37m.\n", C_PREFIX_INFO, name, SERVER_PORT);
+
+	return server_fd;
+}
+
+const listener_t *listener_find(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0)
+		return NULL;
+
+	for (size_t i = 0; i < SERVER_LISTENERS_COUNT; ++i)
+	{
+		const listener_t *listener = &server_listeners[i];
+
+		if (listener->family != addr.ss_family)
+			continue;
+
+		switch (listener->family)
+		{
+			case AF_INET:
+			{
+				struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+				struct in_addr bound = { .s_addr = INADDR_ANY };
+
+				if (listener->address != NULL && inet_pton(AF_INET, listener->address, &bound) != 1)
+					continue;
+
+				if (addr4->sin_port == htons(SERVER_PORT) && addr4->sin_addr.s_addr == bound.s_addr)
+					return listener;
+
+				break;
+			}
+
+			case AF_INET6:
+			{
+				struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+				struct in6_addr bound = IN6ADDR_ANY_INIT;
+
+				if (listener->address != NULL && inet_pton(AF_INET6, listener->address, &bound) != 1)
+					continue;
+
+				if (addr6->sin6_port == htons(SERVER_PORT) && memcmp(&addr6->sin6_addr, &bound, sizeof(bound)) == 0)
+					return listener;
+
+				break;
+			}
+
+			case AF_UNIX:
+			{
+				struct sockaddr_un *addrun = (struct sockaddr_un *)&addr;
+
+				if (listener->address != NULL && strncmp(addrun->sun_path, listener->address, sizeof(addrun->sun_path)) == 0)
+					return listener;
+
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Wake the reactor up from a signal handler, so it stops and run_server() takes over.
+ * @note Async-signal-safe. If the reactor isn't running, it stops as soon as it's started again.
+*/
+static void signal_wake() {
+	int saved_errno = errno;
+	ssize_t ret = write(signal_pipe[1], "", 1);
+
+	(void)ret;
+	errno = saved_errno;
+}
+
+void signal_handler(int sig) {
+	(void)sig;
+
+	shutdown_requested = 1;
+	signal_wake();
+}
+
+void restart_handler(int sig) {
+	(void)sig;
+
+	restart_requested = 1;
+	signal_wake();
 }
 
-void signal_handler() {
+void *signal_pipe_handler(int fd, void *react) {
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	// Stop the reactor thread from within, WaitFor() in run_server() returns right after.
+	((reactor_t_ptr)react)->running = false;
+
+	return react;
+}
+
+void run_server() {
+	addInternalFd(reactor, signal_pipe[0], signal_pipe_handler);
+
+	while (true)
+	{
+		startReactor(reactor);
+		WaitFor(reactor);
+
+		// The reactor stopped by itself (a fatal error), or was asked to shut down.
+		if (shutdown_requested || !restart_requested)
+			break;
+
+		restart_requested = 0;
+		hot_restart();
+
+		if (shutdown_requested)
+			break;
+	}
+
+	server_shutdown();
+}
+
+void server_shutdown() {
 	fprintf(stdout, "%s%s Server shutting down...\n", MACRO_CLEANUP, C_PREFIX_INFO);
 	
 	if (reactor != NULL)
@@ -138,10 +511,30 @@ void signal_handler() {
 			curr = curr->next;
 
 			close(prev->fd);
+			free(prev->ctx);
 			free(prev);
 		}
 
 		free(reactor);
+		reactor = NULL;
+
+		close(signal_pipe[1]);
+
+		if (SERVER_LOG_MSGS)
+			log_close();
+
+		if (SERVER_UDP_RELAY)
+			udp_relay_close();
+
+		if (SERVER_CAPTURE)
+			capture_close();
+
+		// The Unix domain socket paths now belong to the new process.
+		for (size_t i = 0; i < SERVER_LISTENERS_COUNT && !handed_off; ++i)
+		{
+			if (server_listeners[i].enabled && server_listeners[i].family == AF_UNIX)
+				unlink(server_listeners[i].address);
+		}
 
 		fprintf(stdout, "%s Memory cleanup complete, may the force be with you.\n", C_PREFIX_INFO);
 		fprintf(stdout, "%s Statistics:\n", C_PREFIX_INFO);
@@ -150,6 +543,10 @@ void signal_handler() {
 						total_bytes_received, total_bytes_received / 1024, (total_bytes_received / 1024) / 1024);
 		fprintf(stdout, "%s Total bytes sent in this session: %lu bytes (%lu KB / %lu MB).\n", C_PREFIX_INFO, 
 						total_bytes_sent, total_bytes_sent / 1024, (total_bytes_sent / 1024) / 1024);
+		fprintf(stdout, "%s Clients throttled in this session: %lu times.\n", C_PREFIX_INFO, throttle_count);
+
+		if (SERVER_UDP_RELAY)
+			fprintf(stdout, "%s UDP datagrams sent in this session: %lu.\n", C_PREFIX_INFO, udp_relay_sent());
 
 		if (client_count > 0)
 		{
@@ -170,17 +567,141 @@ void signal_handler() {
 	exit(EXIT_SUCCESS);
 }
 
+void hot_restart() {
+	int handoff_fds[2] = { -1, -1 };
+	uint32_t handed_clients = 0;
+	char ack = 0;
+
+	fprintf(stdout, "%s%s Hot restart requested...\n", MACRO_CLEANUP, C_PREFIX_INFO);
+
+	if (reactor == NULL || handed_off)
+	{
+		fprintf(stderr, "%s Hot restart is unavailable, ignoring.\n", C_PREFIX_WARNING);
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, handoff_fds) < 0)
+	{
+		fprintf(stderr, "%s socketpair() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return;
+	}
+
+	// The reactor is stopped, so nothing is read or accepted while the file descriptors change hands.
+	pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		fprintf(stderr, "%s fork() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(handoff_fds[0]);
+		close(handoff_fds[1]);
+		return;
+	}
+
+	else if (pid == 0)
+	{
+		char env_value[16] = { 0 };
+
+		// The new process gets its file descriptors only through the handoff socket.
+		for (reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head; curr != NULL; curr = curr->next)
+			close(curr->fd);
+
+		close(handoff_fds[0]);
+
+		snprintf(env_value, sizeof(env_value), "%d", handoff_fds[1]);
+		setenv(SERVER_HANDOFF_ENV, env_value, 1);
+
+		// Exec the binary at the path it was started from, which may be a new one by now.
+		if (server_exe_path[0] == '\0')
+		{
+			fprintf(stderr, "%s Can't tell the path of the server binary.\n", C_PREFIX_ERROR);
+			_exit(EXIT_FAILURE);
+		}
+
+		execv(server_exe_path, server_argv);
+
+		fprintf(stderr, "%s execv() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	close(handoff_fds[1]);
+
+	int handed_listeners = handoff_send(handoff_fds[0], SERVER_HANDOFF_CLIENTS, &handed_clients);
+
+	// Nothing changed hands until the new process acknowledged it, run_server() resumes the service.
+	if (handed_listeners < 0 || read(handoff_fds[0], &ack, 1) != 1)
+	{
+		fprintf(stderr, "%s Hot restart failed, resuming service.\n", C_PREFIX_ERROR);
+
+		// The new process exits once its end of the handoff socket is closed, reap it.
+		close(handoff_fds[0]);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	close(handoff_fds[0]);
+	handed_off = true;
+
+	// A new process of another version takes over the listeners only, the clients stay here.
+	if (ack == 0 && handed_clients > 0)
+	{
+		fprintf(stderr, "%s New server process %d runs another handoff version, keeping the clients.\n", C_PREFIX_WARNING, pid);
+		handed_clients = 0;
+	}
+
+	fprintf(stdout, "%s Handed off %d listeners and %u clients, new server process %d took over.\n", C_PREFIX_INFO, handed_listeners, handed_clients, pid);
+
+	if ((SERVER_HANDOFF_CLIENTS && ack != 0) || active_clients == 0)
+	{
+		shutdown_requested = 1;
+		return;
+	}
+
+	// Stop accepting, and keep relaying between the remaining clients until they leave.
+	reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head;
+
+	while (curr != NULL)
+	{
+		reactor_node_ptr next = curr->next;
+
+		if (curr->type == FD_TYPE_LISTENER)
+		{
+			close(curr->fd);
+			removeFd(reactor, curr->fd);
+		}
+
+		curr = next;
+	}
+
+	fprintf(stdout, "%s Draining %u clients, for up to %d seconds.\n", C_PREFIX_INFO, active_clients, SERVER_DRAIN_TIMEOUT);
+
+	draining = true;
+	alarm(SERVER_DRAIN_TIMEOUT);
+}
+
 void *client_handler(int fd, void *react) {
+	client_t_ptr client = (client_t_ptr)getFdContext(react, fd);
+
+	// A replay in progress goes on whenever the client has room for more, see log_handle_request().
+	if (SERVER_LOG_MSGS)
+		log_replay_continue(react, fd, client);
+
 	char *buf = (char *)calloc(MAX_BUFFER, sizeof(char));
 
 	if (buf == NULL)
 	{
 		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		close(fd);
+		client_close(fd, client);
 		return NULL;
 	}
 
-	int bytes_read = recv(fd, buf, MAX_BUFFER, 0);
+	// The handler is called on POLLOUT too while a replay is in progress, so there may be nothing to read.
+	int bytes_read = recv(fd, buf, MAX_BUFFER, MSG_DONTWAIT);
+
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		free(buf);
+		return react;
+	}
 
 	if (bytes_read <= 0)
 	{
@@ -188,15 +709,81 @@ void *client_handler(int fd, void *react) {
 			fprintf(stderr, "%s recv() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
 
 		else
-			fprintf(stdout, "%s Client %d disconnected.\n", C_PREFIX_WARNING, fd);
-		
+			fprintf(stdout, "%s Client %u disconnected.\n", C_PREFIX_WARNING, (client != NULL ? client->id : (uint32_t)fd));
+
 		free(buf);
-		close(fd);
+		client_close(fd, client);
+		return NULL;
+	}
+
+	// Captured as it was read, before the message is touched.
+	if (SERVER_CAPTURE)
+		capture_data((client != NULL ? client->id : (uint32_t)fd), buf, bytes_read);
+
+	bool ret = handle_message(react, fd, client, buf, bytes_read);
+
+	free(buf);
+
+	// The reactor drops the node, but the client still holds its admission slot until it's closed.
+	if (!ret)
+	{
+		client_close(fd, client);
 		return NULL;
 	}
 
+	// Charge the client for what it sent, it's paused if it went over its rate limits.
+	if (bucket_consume(client, react, fd, bytes_read))
+		fprintf(stdout, "%s Client %u went over its rate limit, throttled.\n", C_PREFIX_WARNING, client->id);
+
+	return react;
+}
+
+void client_coroutine(int fd, void *react, void *arg) {
+	char buf[MAX_BUFFER];
+	ssize_t bytes_read = 0;
+
+	(void)arg;
+
+	while ((bytes_read = co_read(fd, buf, MAX_BUFFER)) > 0)
+	{
+		client_t_ptr client = (client_t_ptr)getFdContext(react, fd);
+
+		if (SERVER_CAPTURE)
+			capture_data((client != NULL ? client->id : (uint32_t)fd), buf, (size_t)bytes_read);
+
+		if (!handle_message(react, fd, client, buf, (int)bytes_read))
+			break;
+
+		// A throttled client simply sleeps, and the other clients are served meanwhile.
+		uint64_t throttled = bucket_consume(client, react, fd, (size_t)bytes_read);
+
+		if (throttled > 0)
+		{
+			fprintf(stdout, "%s Client %u went over its rate limit, throttled.\n", C_PREFIX_WARNING, client->id);
+			co_sleep(throttled);
+		}
+	}
+
+	// A cancelled coroutine was removed on purpose, it only cleans up.
+	if (bytes_read < 0 && errno != ECANCELED)
+		fprintf(stderr, "%s recv() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	else if (bytes_read == 0)
+	{
+		client_t_ptr client = (client_t_ptr)getFdContext(react, fd);
+
+		fprintf(stdout, "%s Client %u disconnected.\n", C_PREFIX_WARNING, (client != NULL ? client->id : (uint32_t)fd));
+	}
+
+	client_close(fd, (client_t_ptr)getFdContext(react, fd));
+}
+
+bool handle_message(void *react, int fd, client_t_ptr client, char *buf, int bytes_read) {
 	total_bytes_received += bytes_read;
 
+	if (client != NULL)
+		client->bytes_received += bytes_read;
+
 	// Make sure the buffer is null-terminated, so we can print it.
 	if (bytes_read < MAX_BUFFER)
 		*(buf + bytes_read) = '\0';
@@ -218,69 +805,256 @@ void *client_handler(int fd, void *react) {
 		}
 	}
 
+	// Token requests of UDP subscribers are answered, and not relayed.
+	if (SERVER_UDP_RELAY && udp_relay_request(fd, client, buf))
+		return true;
+
+	// Replay requests ("/last <count>", "/since <unix time>") are answered from the log, and not relayed.
+	if (SERVER_LOG_MSGS && log_handle_request(react, fd, client, buf))
+		return true;
+
 	// Print the message to the server.
 	// We don't need to print it if the server is not configured to print messages.
 	if (SERVER_PRINT_MSGS)
-		fprintf(stdout, "%s Client %d: %s\n", C_PREFIX_MESSAGE, fd, buf);
+		fprintf(stdout, "%s Client %u: %s\n", C_PREFIX_MESSAGE, (client != NULL ? client->id : (uint32_t)fd), buf);
 
-	// Send the message back to all except the sender.
-	// We don't need to send it back to the sender, as the sender already has the message.
-	// We also don't need to send it back to the server listening socket, as it will result in an error.
-	// We also know that the server listening socket is the first node in the list, so we can skip it,
-	// and start from the second node, which can't be NULL, as we already know there is at least one client connected.
+	// Log the message, and send it back to all except the sender.
 	// We don't need to send it to the client if the server is not configured to relay messages.
-	if (SERVER_RELAY)
+	if (SERVER_RELAY || SERVER_LOG_MSGS || SERVER_UDP_RELAY)
 	{
-		reactor_node_ptr curr = ((reactor_t_ptr)react)->head->next;
-
 		char *buf_copy = (char *)calloc(bytes_read + SERVER_RLY_MSG_LEN, sizeof(char));
 
 		if (buf_copy == NULL)
 		{
 			fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-			free(buf);
-			return NULL;
+			return false;
 		}
 
-		snprintf(buf_copy, bytes_read + SERVER_RLY_MSG_LEN, "Message from client %d: %s", fd, buf);
+		int prefix_len = snprintf(buf_copy, bytes_read + SERVER_RLY_MSG_LEN, "Message from client %u: ", (client != NULL ? client->id : (uint32_t)fd));
+		int msg_len = (bytes_read < MAX_BUFFER ? bytes_read : MAX_BUFFER - 1);
 
-		while (curr != NULL)
+		// The message is copied as is, it may have null bytes in it.
+		memcpy(buf_copy + prefix_len, buf, msg_len);
+
+		if (SERVER_LOG_MSGS)
+			log_append((client != NULL ? client->id : (uint32_t)fd), buf_copy, bytes_read + SERVER_RLY_MSG_LEN);
+
+		// UDP subscribers get the message once per group (or batch of endpoints), relay_message() skips them.
+		if (SERVER_UDP_RELAY)
+			udp_relay_send((client != NULL ? client->id : (uint32_t)fd), buf_copy, (size_t)(prefix_len + msg_len));
+
+		if (SERVER_RELAY)
+			relay_message(react, fd, buf_copy, bytes_read + SERVER_RLY_MSG_LEN);
+
+		free(buf_copy);
+	}
+
+	return true;
+}
+
+/*
+ * @brief A relayed message that a coroutine client had no room for, to be sent once it has.
+*/
+typedef struct _relay_pending
+{
+	// The file descriptor of the client.
+	int fd;
+
+	// The reference ID of the client, in case it left and its file descriptor was reused meanwhile.
+	uint32_t id;
+
+	// The number of bytes of the message already sent.
+	size_t offset;
+} relay_pending_t;
+
+/*
+ * @brief Finish a relay to a coroutine client that was full, waiting for room in it.
+ * @param react The reactor.
+ * @param pending The relay.
+ * @param msg The message.
+ * @param len The length of the message.
+ * @note Must be called from a coroutine, otherwise the message is dropped.
+*/
+static void relay_pending_send(void *react, relay_pending_t *pending, const char *msg, size_t len) {
+	while (true)
+	{
+		// The client is looked up again after every wait, as it may have left meanwhile.
+		client_t_ptr peer = (client_t_ptr)getFdContext(react, pending->fd);
+
+		// A client that asked for a replay meanwhile gets the message from the log.
+		if (peer == NULL || peer->id != pending->id || (pending->offset == 0 && peer->replay.active))
+			return;
+
+		// Only the writer that started a message on the client may write to it, until the message is done.
+		if (pending->offset > 0 || !peer->relay_busy)
+		{
+			ssize_t bytes_write = send(pending->fd, msg + pending->offset, len - pending->offset, MSG_NOSIGNAL);
+
+			if (bytes_write > 0)
+				pending->offset += (size_t)bytes_write;
+
+			if (pending->offset == len)
+			{
+				peer->relay_busy = false;
+				peer->bytes_sent += len;
+				total_bytes_sent += len;
+				return;
+			}
+
+			// The client failed, and is removed in the next poll() round.
+			if (bytes_write < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				peer->relay_busy = false;
+				return;
+			}
+
+			peer->relay_busy = (pending->offset > 0);
+		}
+
+		if (co_wait(pending->fd, POLLOUT) < 0)
+		{
+			fprintf(stderr, "%s Client %u can't keep up, message dropped.\n", C_PREFIX_WARNING, pending->id);
+
+			if (pending->offset > 0)
+				peer->relay_busy = false;
+
+			return;
+		}
+	}
+}
+
+/*
+ * @brief Add a relay to the list of relays to finish once their clients have room.
+ * @param pending The list, grown as needed.
+ * @param count The number of relays in the list.
+ * @param capacity The capacity of the list.
+ * @param fd The file descriptor of the client.
+ * @param id The reference ID of the client.
+ * @param offset The number of bytes of the message already sent.
+ * @return true on success, false if the relay was dropped.
+*/
+static bool relay_defer(relay_pending_t **pending, size_t *count, size_t *capacity, int fd, uint32_t id, size_t offset) {
+	if (*count == *capacity)
+	{
+		size_t new_capacity = (*capacity == 0 ? 16 : *capacity * 2);
+		relay_pending_t *grown = (relay_pending_t *)realloc(*pending, new_capacity * sizeof(relay_pending_t));
+
+		if (grown == NULL)
 		{
-			if (curr->fd != fd)
+			fprintf(stderr, "%s realloc() failed: %s, message to client %u dropped.\n", C_PREFIX_ERROR, strerror(errno), id);
+			return false;
+		}
+
+		*pending = grown;
+		*capacity = new_capacity;
+	}
+
+	(*pending)[*count].fd = fd;
+	(*pending)[*count].id = id;
+	(*pending)[*count].offset = offset;
+	(*count)++;
+
+	return true;
+}
+
+void relay_message(void *react, int fd, const char *msg, size_t len) {
+	reactor_node_ptr curr = ((reactor_t_ptr)react)->head;
+	relay_pending_t *pending = NULL;
+	size_t pending_count = 0, pending_capacity = 0;
+
+	// We don't need to send it back to the sender, as the sender already has the message.
+	// We also don't need to send it back to the server listening sockets or internal file descriptors,
+	// as it will result in an error, so every node that isn't tagged as a client is skipped.
+	while (curr != NULL)
+	{
+		if (curr->fd != fd && curr->type == FD_TYPE_CLIENT)
+		{
+			client_t_ptr peer = (client_t_ptr)curr->ctx;
+
+			// A client in the middle of a replay gets the message from the log, once it caught up, see log_handle_request().
+			if (peer != NULL && peer->replay.active)
 			{
-				int bytes_write = send(curr->fd, buf_copy, bytes_read + SERVER_RLY_MSG_LEN, 0);
+				curr = curr->next;
+				continue;
+			}
+
+			// A client with a registered UDP endpoint already got the message there, see udp_relay_send().
+			if (SERVER_UDP_RELAY && peer != NULL && peer->udp_endpoints > 0)
+			{
+				curr = curr->next;
+				continue;
+			}
 
-				if (bytes_write < 0)
+			// Shared-memory clients get the message through their ring, without a syscall per byte.
+			if (peer != NULL && peer->shm != NULL)
+			{
+				if (shm_session_send(peer->shm, msg, len))
 				{
-					fprintf(stderr, "%s send() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-					free(buf);
-					return NULL;
+					total_bytes_sent += len;
+					peer->bytes_sent += len;
 				}
 
-				else if (bytes_write == 0)
-					fprintf(stderr, "%s Client %d disconnected, expected to be remove in next poll() round.\n", C_PREFIX_WARNING, curr->fd);
+				curr = curr->next;
+				continue;
+			}
+
+			bool busy = (curr->co != NULL && peer != NULL && peer->relay_busy);
+			int bytes_write = 0;
 
-				else if (bytes_write < (bytes_read + SERVER_RLY_MSG_LEN))
-					fprintf(stderr, "%s send() sent less bytes than expected, check your network.\n", C_PREFIX_WARNING);
+			// A peer that closed its end mustn't take the server down with SIGPIPE.
+			// One that another coroutine is in the middle of writing to gets the message after it, below.
+			if (!busy)
+				bytes_write = send(curr->fd, msg, len, MSG_NOSIGNAL);
 
-				else
-					total_bytes_sent += bytes_write;
+			// A coroutine client is non-blocking - whatever it had no room for is sent once the list is done.
+			if (curr->co != NULL && peer != NULL && (busy || (bytes_write >= 0 && (size_t)bytes_write < len) || (bytes_write < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))))
+			{
+				size_t offset = (bytes_write > 0 ? (size_t)bytes_write : 0);
+
+				if (relay_defer(&pending, &pending_count, &pending_capacity, curr->fd, peer->id, offset) && offset > 0)
+					peer->relay_busy = true;
 			}
 
-			curr = curr->next;
+			else if (bytes_write < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				fprintf(stderr, "%s Client %d can't keep up, message dropped.\n", C_PREFIX_WARNING, curr->fd);
+
+			else if (bytes_write < 0 && (errno == EPIPE || errno == ECONNRESET))
+				fprintf(stderr, "%s Client %d disconnected, expected to be remove in next poll() round.\n", C_PREFIX_WARNING, curr->fd);
+
+			// It's the peer that failed, not the sender - the rest of the clients still get the message.
+			else if (bytes_write < 0)
+				fprintf(stderr, "%s send() to client %d failed: %s, skipped.\n", C_PREFIX_ERROR, curr->fd, strerror(errno));
+
+			else if (bytes_write == 0)
+				fprintf(stderr, "%s Client %d disconnected, expected to be remove in next poll() round.\n", C_PREFIX_WARNING, curr->fd);
+
+			else if ((size_t)bytes_write < len)
+				fprintf(stderr, "%s send() sent less bytes than expected, check your network.\n", C_PREFIX_WARNING);
+
+			else
+			{
+				total_bytes_sent += bytes_write;
+
+				if (peer != NULL)
+					peer->bytes_sent += bytes_write;
+			}
 		}
 
-		free(buf_copy);
+		curr = curr->next;
 	}
 
-	free(buf);
+	// Nothing above yields, so the list stayed intact - from here on, the coroutine waits, and clients may leave meanwhile.
+	for (size_t i = 0; i < pending_count; ++i)
+		relay_pending_send(react, &pending[i], msg, len);
 
-	return react;
+	free(pending);
 }
 
 void *server_handler(int fd, void *react) {
-	struct sockaddr_in client_addr;
+	struct sockaddr_storage client_addr;
 	socklen_t client_len = sizeof(client_addr);
+	char client_ip[INET6_ADDRSTRLEN] = { 0 };
+	int client_port = 0;
 
 	reactor_t_ptr reactor = (reactor_t_ptr)react;
 
@@ -291,21 +1065,175 @@ void *server_handler(int fd, void *react) {
 		return NULL;
 	}
 
-	int client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
+	int client_fd = accept_client(reactor, fd, (struct sockaddr *)&client_addr, &client_len);
 
-	// Sanity check.
+	// The listener stays, whether or not a client was admitted.
 	if (client_fd < 0)
+		return react;
+
+	switch (client_addr.ss_family)
 	{
-		fprintf(stderr, "%s accept() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-		return NULL;
+		case AF_INET:
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&client_addr)->sin_addr, client_ip, sizeof(client_ip));
+			client_port = ntohs(((struct sockaddr_in *)&client_addr)->sin_port);
+			break;
+
+		case AF_INET6:
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&client_addr)->sin6_addr, client_ip, sizeof(client_ip));
+			client_port = ntohs(((struct sockaddr_in6 *)&client_addr)->sin6_port);
+			break;
+
+		default:
+			strncpy(client_ip, "unix", sizeof(client_ip) - 1);
+			break;
+	}
+
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t));
+
+	if (client == NULL)
+	{
+		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(client_fd);
+		return react;
+	}
+
+	client->id = ++client_count;
+
+	// The client gets the rate limits of the listener that accepted it.
+	bucket_init(&client->bucket, reactor, fd);
+
+	fprintf(stdout, "%s Client %s:%d connected, Reference ID: %u\n", C_PREFIX_INFO, client_ip, client_port, client->id);
+
+	if (SERVER_CAPTURE)
+		capture_accept(client->id);
+
+	// Add the client to the reactor, with its per-connection state.
+	if (SERVER_COROUTINES)
+	{
+		if (co_spawn(reactor, client_fd, client_coroutine, NULL) < 0)
+		{
+			free(client);
+			close(client_fd);
+			return react;
+		}
 	}
 
-	fprintf(stdout, "%s Client %s:%d connected, Reference ID: %d\n", C_PREFIX_INFO, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+	else
+		addFd(reactor, client_fd, client_handler);
 
-	// Add the client to the reactor.
-	addFd(reactor, client_fd, client_handler);
+	setFdContext(reactor, client_fd, client);
 
-	client_count++;
+	active_clients++;
 
 	return react;
-}
\ No newline at end of file
+}
+
+/*
+ * @brief Pause or resume all the listeners.
+ * @param react The reactor.
+ * @param usec For how long to pause them, in microseconds, 0 to pause them until resumed, or -1 to resume them.
+*/
+static void set_listeners_paused(void *react, int64_t usec) {
+	for (reactor_node_ptr curr = ((reactor_t_ptr)react)->head; curr != NULL; curr = curr->next)
+	{
+		if (curr->type != FD_TYPE_LISTENER)
+			continue;
+
+		if (usec < 0)
+			resumeFd(react, curr->fd);
+
+		else
+			pauseFd(react, curr->fd, (uint64_t)usec);
+	}
+}
+
+int accept_client(void *react, int fd, struct sockaddr *addr, socklen_t *addr_len) {
+	// A full server turns away whoever is still in the backlog.
+	if (SERVER_MAX_CLIENTS > 0 && active_clients >= SERVER_MAX_CLIENTS)
+	{
+		int excess_fd = accept(fd, NULL, NULL);
+
+		if (excess_fd >= 0)
+			close(excess_fd);
+
+		fprintf(stderr, "%s Server is full (%u clients), connection refused.\n", C_PREFIX_WARNING, active_clients);
+		return -1;
+	}
+
+	int client_fd = accept(fd, addr, addr_len);
+
+	if (client_fd < 0)
+	{
+		if (errno != EMFILE && errno != ENFILE)
+		{
+			fprintf(stderr, "%s accept() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+			return -1;
+		}
+
+		// Out of file descriptors - the connection would stay pending, and the listener readable forever.
+		// Free the reserved one, to accept and close it, and back off for a while.
+		fprintf(stderr, "%s accept() failed: %s, connection refused.\n", C_PREFIX_WARNING, strerror(errno));
+
+		if (reserve_fd >= 0)
+		{
+			close(reserve_fd);
+
+			int excess_fd = accept(fd, NULL, NULL);
+
+			if (excess_fd >= 0)
+				close(excess_fd);
+
+			reserve_fd = open("/dev/null", O_RDONLY);
+
+			if (reserve_fd >= 0)
+				fcntl(reserve_fd, F_SETFD, FD_CLOEXEC);
+		}
+
+		set_listeners_paused(react, SERVER_ACCEPT_BACKOFF * 1000);
+		return -1;
+	}
+
+	// The last client that fits - stop listening until enough clients leave.
+	admission_check(react, active_clients + 1);
+
+	return client_fd;
+}
+
+void admission_check(void *react, uint32_t clients) {
+	if (SERVER_MAX_CLIENTS > 0 && clients >= SERVER_MAX_CLIENTS && !admission_paused)
+	{
+		admission_paused = true;
+		admission_resume = (uint32_t)((uint64_t)SERVER_MAX_CLIENTS * (100 - SERVER_ADMIT_HYSTERESIS) / 100);
+
+		fprintf(stdout, "%s Server is full (%u clients), listeners paused until %u clients are left.\n", C_PREFIX_WARNING, clients, admission_resume);
+		set_listeners_paused(react, 0);
+	}
+}
+
+void client_close(int fd, client_t_ptr client) {
+	if (SERVER_CAPTURE)
+		capture_disconnect((client != NULL ? client->id : (uint32_t)fd));
+
+	if (SERVER_UDP_RELAY)
+		udp_relay_forget(client);
+
+	client_disconnected();
+	close(fd);
+}
+
+void client_disconnected() {
+	if (active_clients > 0)
+		active_clients--;
+
+	if (admission_paused && active_clients <= admission_resume)
+	{
+		admission_paused = false;
+
+		fprintf(stdout, "%s Server has room again (%u clients), listeners resumed.\n", C_PREFIX_INFO, active_clients);
+		set_listeners_paused(reactor, -1);
+	}
+
+	// The last client of a draining process left, nothing is left to do.
+	if (draining && active_clients == 0)
+		signal_handler(SIGINT);
+}
@@ -35,9 +35,11 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sys/socket.h>
 
 
 /********************/
@@ -50,6 +52,30 @@
 */
 #define SERVER_PORT 		9034
 
+/*
+ * @brief Defines whether the server also listens on IPv6.
+ * @note The default value is 1.
+ * @note A value of 0 means that the server will only listen on IPv4 (and Unix domain, if enabled).
+ * @note A value of 1 means that the server will also listen on IPv6, on the same port (IPV6_V6ONLY).
+*/
+#define SERVER_LISTEN_IPV6	1
+
+/*
+ * @brief Defines whether the server also listens on a Unix domain socket.
+ * @note The default value is 1.
+ * @note A value of 0 means that the server won't create a Unix domain socket.
+ * @note A value of 1 means that the server will listen on SERVER_UNIX_PATH as well,
+ * 			so co-located processes can connect without going through the TCP/IP stack.
+*/
+#define SERVER_LISTEN_UNIX	1
+
+/*
+ * @brief The path of the Unix domain listening socket.
+ * @note The default path is /tmp/react_server.sock.
+ * @note The path is unlinked before binding and when the server shuts down.
+*/
+#define SERVER_UNIX_PATH	"/tmp/react_server.sock"
+
 /*
  * @brief The maximum number of clients that can connect to the server.
  * @note The default number is 16384 clients.
@@ -71,11 +97,38 @@
 */
 #define POLL_TIMEOUT 		-1
 
+/*
+ * @brief The CPU to pin the reactor thread to, when created with createReactor().
+ * @note The default value is -1.
+ * @note A value of -1 means that the reactor thread isn't pinned, and the scheduler may migrate it freely.
+*/
+#define REACTOR_CPU_AFFINITY	-1
+
+/*
+ * @brief Defines whether the reactor allocates its memory on the NUMA node it runs on, when created with createReactor().
+ * @note The default value is 0.
+ * @note A value of 1 means that the reactor thread sets a local memory policy, and preallocates its poll array
+ * 			for MAX_QUEUE file descriptors from within the thread. Best used together with REACTOR_CPU_AFFINITY.
+*/
+#define REACTOR_NUMA_LOCAL		0
+
+/*
+ * @brief The adaptive spin window of the reactor, in microseconds, when created with createReactor().
+ * @note The default value is 0.
+ * @note A value of 0 means that the reactor always blocks in poll() for POLL_TIMEOUT.
+ * @note A positive value means that after each event, the reactor keeps polling with a zero timeout for
+ * 			this long before falling back to blocking, trading a core for lower wakeup latency.
+*/
+#define REACTOR_SPIN_USEC		0
+
 /*
  * @brief Defines whether the server is a relay server or not.
  * @note The default value is 1.
  * @note A value of 0 means that the server is not a relay server, and thus will not forward messages to other clients.
  * @note A value of 1 means that the server is a relay server, and thus will forward messages to other clients.
+ * @note A message that is exactly a request - "/last <count>" or "/since <unix time>" (see msg_log.h), or "/udp"
+ * 			(see udp_relay.h), maybe followed by a newline - is answered, and not relayed. Any other message is relayed
+ * 			as is, even if it starts with one of them (e.g. "/last 3 days were fun").
 */
 #define SERVER_RELAY		1
 
@@ -87,6 +140,116 @@
 */
 #define SERVER_PRINT_MSGS	1
 
+/*
+ * @brief Defines whether the server offers a shared-memory transport to co-located clients.
+ * @note The default value is 1.
+ * @note A value of 1 means that the server listens on SHM_SERVER_PATH (see shm_ring.h), and every
+ * 			connection there gets its own pair of rings in a shared memory segment, with eventfd doorbells.
+*/
+#define SERVER_LISTEN_SHM	1
+
+/*
+ * @brief The maximum number of clients connected at once.
+ * @note The default value is MAX_QUEUE.
+ * @note When the server is full, its listeners are paused, and connections that still get through are accepted and closed right away.
+*/
+#define SERVER_MAX_CLIENTS	MAX_QUEUE
+
+/*
+ * @brief How far below the point it was paused at the server must get before its listeners are resumed, in percent.
+ * @note The default value is 10 percent, so a full server accepts again at 90 percent of SERVER_MAX_CLIENTS.
+ * @note Avoids pausing and resuming the listeners on every single connection and disconnection.
+*/
+#define SERVER_ADMIT_HYSTERESIS	10
+
+/*
+ * @brief For how long the listeners are paused when the process runs out of file descriptors (EMFILE / ENFILE), in milliseconds.
+ * @note The default value is 100 milliseconds.
+*/
+#define SERVER_ACCEPT_BACKOFF	100
+
+/*
+ * @brief The default rate at which a single network client (IPv4 or IPv6) may send, in bytes per second.
+ * @note The default value is 0.
+ * @note A value of 0 means no limit. A client that goes over the limit isn't read from until it's back
+ * 			under it, so the kernel pushes back on it, instead of its messages being amplified to every client.
+ * @note Used by the network listeners in SERVER_LISTENERS, each of which may set limits of its own instead.
+*/
+#define SERVER_RATE_BYTES	0
+
+/*
+ * @brief The default rate at which a single network client (IPv4 or IPv6) may send, in messages per second.
+ * @note The default value is 0.
+ * @note A value of 0 means no limit.
+*/
+#define SERVER_RATE_MSGS	0
+
+/*
+ * @brief The default rate at which a single local client (Unix domain or shared memory) may send, in bytes per second.
+ * @note The default value is 0.
+ * @note A value of 0 means no limit.
+ * @note Used by the local listeners in SERVER_LISTENERS, each of which may set limits of its own instead.
+*/
+#define SERVER_LOCAL_RATE_BYTES	0
+
+/*
+ * @brief The default rate at which a single local client (Unix domain or shared memory) may send, in messages per second.
+ * @note The default value is 0.
+ * @note A value of 0 means no limit.
+*/
+#define SERVER_LOCAL_RATE_MSGS	0
+
+/*
+ * @brief For how long a client may burst above its rate, in milliseconds.
+ * @note The default value is 1000 milliseconds, meaning a client may send a full second worth of data at once.
+*/
+#define SERVER_RATE_BURST_MS	1000
+
+/*
+ * @brief The listeners of the server - each one's tag, address family, address, whether it's enabled,
+ * 			handler and the rate limits (bytes and messages per second) of the clients it accepts.
+ * @note The address is the IP address to bind to on SERVER_PORT (NULL for any address), or the path of a Unix domain socket.
+ * @note The first listener is required, the server can still serve its clients without the others.
+ * @note Limits are per listener, so two listeners of the same family may differ, e.g. a listener on ::1
+ * 			for local clients may allow more than the one on any address.
+*/
+#define SERVER_LISTENERS { \
+	{ "IPv4", AF_INET, NULL, 1, server_handler, { SERVER_RATE_BYTES, SERVER_RATE_MSGS } }, \
+	{ "IPv6", AF_INET6, NULL, SERVER_LISTEN_IPV6, server_handler, { SERVER_RATE_BYTES, SERVER_RATE_MSGS } }, \
+	{ "Unix domain", AF_UNIX, SERVER_UNIX_PATH, SERVER_LISTEN_UNIX, server_handler, { SERVER_LOCAL_RATE_BYTES, SERVER_LOCAL_RATE_MSGS } }, \
+	{ "Shared-memory", AF_UNIX, SHM_SERVER_PATH, SERVER_LISTEN_SHM, shm_server_handler, { SERVER_LOCAL_RATE_BYTES, SERVER_LOCAL_RATE_MSGS } } \
+}
+
+/*
+ * @brief Defines whether each client is served by a coroutine (client_coroutine()), instead of a handler (client_handler()).
+ * @note The default value is 0.
+ * @note A value of 1 means that each client runs sequential code in a coroutine of its own, see coroutine.h.
+*/
+#define SERVER_COROUTINES	0
+
+/*
+ * @brief Defines whether a hot restart (SIGUSR2) also hands off the established clients.
+ * @note The default value is 1.
+ * @note A value of 0 means that only the listening sockets are handed off, and the old process
+ * 			keeps serving its existing clients until they disconnect, or SERVER_DRAIN_TIMEOUT expires.
+ * @note A value of 1 means that the listening sockets and all clients, with their per-connection state,
+ * 			are handed off to the new process, and the old process exits right away.
+*/
+#define SERVER_HANDOFF_CLIENTS	1
+
+/*
+ * @brief The maximum time, in seconds, that an old process drains its clients after a hot restart.
+ * @note The default timeout is 30 seconds.
+ * @note Only used when SERVER_HANDOFF_CLIENTS is 0.
+*/
+#define SERVER_DRAIN_TIMEOUT	30
+
+/*
+ * @brief The environment variable used to pass the handoff socket to the new process.
+ * @note The variable holds the file descriptor number of the new process' end of the handoff socket.
+*/
+#define SERVER_HANDOFF_ENV	"REACT_SERVER_HANDOFF_FD"
+
 
 /************************/
 /* Messages definitions */
@@ -129,6 +292,18 @@
 /* Typedefs Section */
 /********************/
 
+/*
+ * @brief The role of a file descriptor inside the reactor.
+ * @note Listeners are never removed by the reactor, even if their handler fails.
+ * @note Only clients are relayed to by client_handler().
+*/
+typedef enum _fd_type
+{
+	FD_TYPE_CLIENT = 0,		// A regular connection, added with addFd().
+	FD_TYPE_LISTENER,		// A listening socket, added with addListener().
+	FD_TYPE_INTERNAL		// An internal notification fd (e.g. an eventfd), added with addInternalFd().
+} fd_type_t;
+
 /*
  * @brief A handler function for a file descriptor.
  * @param fd The file descriptor.
@@ -154,6 +329,41 @@ typedef struct _reactor_t reactor_t, *reactor_t_ptr;
 */
 typedef struct pollfd pollfd_t, *pollfd_t_ptr;
 
+/*
+ * @brief The reactor creation options - CPU affinity, NUMA locality and adaptive spinning.
+*/
+typedef struct _reactor_options_t reactor_options_t, *reactor_options_t_ptr;
+
+/*
+ * @brief Per-connection state of a client, attached to its reactor node.
+*/
+typedef struct _client_t client_t, *client_t_ptr;
+
+/*
+ * @brief Rate limits of a client - bytes and messages per second.
+*/
+typedef struct _rate_limit_t rate_limit_t, *rate_limit_t_ptr;
+
+/*
+ * @brief A token bucket, enforcing the rate limits of a client.
+*/
+typedef struct _token_bucket_t token_bucket_t, *token_bucket_t_ptr;
+
+/*
+ * @brief The position of a replay from the message log, see msg_log.h.
+*/
+typedef struct _log_cursor_t log_cursor_t, *log_cursor_t_ptr;
+
+/*
+ * @brief A listener of the server - its address, its handler and the rate limits of the clients it accepts.
+*/
+typedef struct _listener_t listener_t, *listener_t_ptr;
+
+/*
+ * @brief A shared-memory session of a co-located client, see shm_ring.h.
+*/
+typedef struct _shm_session shm_session_t, *shm_session_t_ptr;
+
 
 /**********************/
 /* Structures Section */
@@ -166,10 +376,16 @@ struct _reactor_node
 {
 	/*
 	 * @brief The file descriptor.
-	 * @note The first node is always the listening socket.
 	*/
 	int fd;
 
+	/*
+	 * @brief The role of the file descriptor (listener or client).
+	 * @note The reactor uses this field, and not the node's position in the list,
+	 * 			to decide whether a failing file descriptor should be removed.
+	*/
+	fd_type_t type;
+
 	/*
 	 * @brief The file descriptor's handler union.
 	 * @note The union is used to allow the handler to be printed as a generic pointer,
@@ -179,8 +395,7 @@ struct _reactor_node
 	{
 		/*
 		 * @brief The file descriptor's handler.
-		 * @note The first node is always the listening socket, and its handler is always
-		 * 			to accept a new connection and add it to the reactor.
+		 * @note For listeners, the handler is always to accept a new connection and add it to the reactor.
 		*/
 		handler_t handler;
 
@@ -191,6 +406,37 @@ struct _reactor_node
 		void *handler_ptr;
 	} hdlr;
 
+	/*
+	 * @brief Whether the file descriptor is paused - left out of poll() until resumed.
+	 * @note See pauseFd() and resumeFd().
+	*/
+	bool paused;
+
+	/*
+	 * @brief When a paused file descriptor is resumed, in nanoseconds of the monotonic clock.
+	 * @note A value of 0 means that the file descriptor stays paused until resumeFd() is called.
+	*/
+	uint64_t resume_at;
+
+	/*
+	 * @brief The events the file descriptor is polled for.
+	 * @note The default is POLLIN. See setFdEvents().
+	*/
+	short events;
+
+	/*
+	 * @brief The coroutine that waits on the file descriptor, or NULL.
+	 * @note See coroutine.h. The reactor releases the coroutine when it removes its file descriptor.
+	*/
+	void *co;
+
+	/*
+	 * @brief Per-connection state attached to the file descriptor, or NULL.
+	 * @note The context must be allocated with malloc(), as the reactor frees it
+	 * 			when it removes the node. See setFdContext() and getFdContext().
+	*/
+	void *ctx;
+
 	/*
 	 * @brief The next node in the linked list.
 	 * @note For the last node, this is NULL.
@@ -198,6 +444,28 @@ struct _reactor_node
 	reactor_node_ptr next;
 };
 
+/*
+ * @brief The reactor creation options - CPU affinity, NUMA locality and adaptive spinning.
+ * @note See REACTOR_CPU_AFFINITY, REACTOR_NUMA_LOCAL and REACTOR_SPIN_USEC for the defaults.
+ */
+struct _reactor_options_t
+{
+	/*
+	 * @brief The CPU to pin the reactor thread to, or -1 for none.
+	*/
+	int cpu;
+
+	/*
+	 * @brief Whether the reactor allocates its memory on the NUMA node it runs on.
+	*/
+	bool numa_local;
+
+	/*
+	 * @brief The adaptive spin window, in microseconds, or 0 to always block in poll().
+	*/
+	uint32_t spin_usec;
+};
+
 /*
  * @brief A reactor object - a linked list of file descriptors and their handlers.
  */
@@ -212,17 +480,27 @@ struct _reactor_t
 
 	/*
 	 * @brief The first node in the linked list.
-	 * @note The first node is always the listening socket.
+	 * @note Listeners and clients may appear anywhere in the list, see reactor_node::type.
 	*/
 	reactor_node_ptr head;
 
 	/*
 	 * @brief A pointer to an array of pollfd structures.
-	 * @note The array is allocated and freed in reactorRun().
+	 * @note The array is allocated and grown in reactorRun(), and freed in stopReactor().
 	 * @note The array is used in reactorRun() to call poll().
 	*/
 	pollfd_t_ptr fds;
 
+	/*
+	 * @brief The number of pollfd structures allocated in fds.
+	*/
+	size_t fds_capacity;
+
+	/*
+	 * @brief The options the reactor was created with.
+	*/
+	reactor_options_t options;
+
 	/*
 	 * @brief A boolean value indicating whether the reactor is running.
 	 * @note The value is set to true in startReactor() and to false in stopReactor().
@@ -231,6 +509,207 @@ struct _reactor_t
 };
 
 
+/*
+ * @brief Rate limits of a client - bytes and messages per second.
+ * @note A value of 0 means no limit.
+*/
+struct _rate_limit_t
+{
+	/*
+	 * @brief The maximum number of bytes per second.
+	*/
+	uint32_t bytes_per_sec;
+
+	/*
+	 * @brief The maximum number of messages (reads) per second.
+	*/
+	uint32_t msgs_per_sec;
+};
+
+/*
+ * @brief A token bucket, enforcing the rate limits of a client.
+ * @note The tokens may go below zero, as a read may bring more bytes than the bucket holds.
+ * 			The client is then paused until the debt is paid back.
+*/
+struct _token_bucket_t
+{
+	/*
+	 * @brief The rate limits the bucket enforces.
+	*/
+	rate_limit_t limit;
+
+	/*
+	 * @brief The bytes the client may still send.
+	*/
+	double bytes;
+
+	/*
+	 * @brief The messages the client may still send.
+	*/
+	double msgs;
+
+	/*
+	 * @brief When the bucket was last refilled, in nanoseconds of the monotonic clock.
+	*/
+	uint64_t last_refill;
+};
+
+/*
+ * @brief The position of a replay from the message log, see log_handle_request().
+ * @note A replay goes on in steps, whenever the client has room for more, until it caught up with the log.
+*/
+struct _log_cursor_t
+{
+	/*
+	 * @brief Whether a replay is in progress - the client isn't relayed messages meanwhile, it gets them from the log.
+	*/
+	bool active;
+
+	/*
+	 * @brief Whether the replay made the socket non-blocking, and it's made blocking again when the replay is done.
+	*/
+	bool nonblock;
+
+	/*
+	 * @brief Whether the replay waits for POLLOUT through the reactor, and not in a coroutine.
+	*/
+	bool polling;
+
+	/*
+	 * @brief The ID of the segment of the next record to send.
+	*/
+	uint32_t segment;
+
+	/*
+	 * @brief The position of the next record to send in its segment.
+	*/
+	uint32_t record;
+
+	/*
+	 * @brief The number of bytes of the next record that were already sent.
+	*/
+	uint32_t partial;
+
+	/*
+	 * @brief The ID of the newest segment when the replay was requested.
+	*/
+	uint32_t end_segment;
+
+	/*
+	 * @brief The number of records in the newest segment when the replay was requested.
+	 * @note The records past it were relayed while the replay was in progress - the client gets them from
+	 * 			the log too, except its own.
+	*/
+	uint32_t end_record;
+
+	/*
+	 * @brief The number of records sent so far.
+	*/
+	uint32_t sent;
+};
+
+/*
+ * @brief A listener of the server, as set in SERVER_LISTENERS - its tag, its address, its handler, and the rate
+ * 			limits of the clients it accepts.
+ * @note A copy is attached to the listener's reactor node, see attach_listener_limit().
+*/
+struct _listener_t
+{
+	/*
+	 * @brief The tag of the listener, as shown in the logs.
+	*/
+	const char *name;
+
+	/*
+	 * @brief The address family: AF_INET, AF_INET6 or AF_UNIX.
+	*/
+	int family;
+
+	/*
+	 * @brief The IP address to bind to (NULL for any address), or the path of a Unix domain socket.
+	*/
+	const char *address;
+
+	/*
+	 * @brief Whether the server listens on it.
+	*/
+	bool enabled;
+
+	/*
+	 * @brief The handler of the listener.
+	*/
+	handler_t handler;
+
+	/*
+	 * @brief The rate limits of the clients the listener accepts.
+	*/
+	rate_limit_t limit;
+};
+
+/*
+ * @brief Per-connection state of a client, attached to its reactor node.
+ * @note The state survives a hot restart, see handoff_send() and handoff_receive().
+*/
+struct _client_t
+{
+	/*
+	 * @brief The client reference ID, as shown in the logs and relayed messages.
+	 * @note The ID is stable across hot restarts, unlike the file descriptor.
+	*/
+	uint32_t id;
+
+	/*
+	 * @brief The total number of bytes received from this client.
+	*/
+	uint64_t bytes_received;
+
+	/*
+	 * @brief The total number of bytes sent to this client.
+	*/
+	uint64_t bytes_sent;
+
+	/*
+	 * @brief The token bucket that enforces the client's rate limits.
+	*/
+	token_bucket_t bucket;
+
+	/*
+	 * @brief The number of times the client was throttled.
+	*/
+	uint32_t throttled;
+
+	/*
+	 * @brief The shared-memory session of the client, or NULL for a socket client.
+	 * @note The session is owned by the node of its doorbell, not by the client.
+	*/
+	shm_session_t_ptr shm;
+
+	/*
+	 * @brief Whether a coroutine is in the middle of writing to the client, so other writers wait for it to finish.
+	 * @note Only coroutine clients are non-blocking, and may be left with a partial message, see relay_message().
+	*/
+	bool relay_busy;
+
+	/*
+	 * @brief The token the client registers its UDP endpoints with, or 0 if it didn't ask for one, see udp_relay.h.
+	 * @note The token is handed off with the client on a hot restart, so its endpoints may register again with the new process.
+	*/
+	uint64_t udp_token;
+
+	/*
+	 * @brief The number of UDP endpoints registered with the client's token.
+	 * @note While there are any, relayed messages reach the client over UDP, and aren't sent over TCP too.
+	 * @note Not handed off on a hot restart, the endpoints register again with the new process.
+	*/
+	uint32_t udp_endpoints;
+
+	/*
+	 * @brief The replay from the message log in progress, if any, see msg_log.h.
+	*/
+	log_cursor_t replay;
+};
+
+
 /********************************/
 /* Functions Declartion Section */
 /********************************/
@@ -242,6 +721,14 @@ struct _reactor_t
  */
 void *createReactor();
 
+/*
+ * @brief Create a reactor object with explicit options.
+ * @param options The reactor options, or NULL for the defaults used by createReactor().
+ * @return A pointer to the created object, or NULL if failed.
+ * @note The returned pointer must be freed.
+ */
+void *createReactorWithOptions(const reactor_options_t *options);
+
 /*
  * @brief Start executing the reactor, in a new thread.
  * @param react A pointer to the reactor object.
@@ -265,6 +752,90 @@ void stopReactor(void *react);
  */
 void addFd(void *react, int fd, handler_t handler);
 
+/*
+ * @brief Add a listening socket to the reactor.
+ * @param react A pointer to the reactor object.
+ * @param fd The listening socket file descriptor (IPv4, IPv6 or Unix domain).
+ * @param handler The handler function to call when a new connection is pending.
+ * @return void
+ * @note Unlike addFd(), the file descriptor is tagged as a listener, and thus is never
+ * 			removed by the reactor, and never relayed to by client_handler().
+ * @note Any number of listeners may be added to the same reactor.
+ */
+void addListener(void *react, int fd, handler_t handler);
+
+/*
+ * @brief Add an internal file descriptor to the reactor, such as an eventfd used as a doorbell.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to add.
+ * @param handler The handler function to call when the file descriptor is ready.
+ * @return void
+ * @note Internal file descriptors are polled and removed like clients, but never relayed to.
+ */
+void addInternalFd(void *react, int fd, handler_t handler);
+
+/*
+ * @brief Remove a file descriptor from the reactor.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to remove.
+ * @return void
+ * @note The file descriptor is not closed, but its context (see setFdContext()) is freed.
+ * @note Safe to call from a handler, even for a file descriptor other than the handler's own.
+ * @note Unlike the automatic removal, this function removes listeners as well.
+ */
+void removeFd(void *react, int fd);
+
+/*
+ * @brief Stop polling a file descriptor, for a while or until resumed.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to pause.
+ * @param usec For how long to pause, in microseconds, or 0 to pause until resumeFd() is called.
+ * @return void
+ * @note While paused, the file descriptor's handler isn't called, and the data the peer sends stays
+ * 			in the kernel, so it pushes back on the peer (e.g. through the TCP window).
+ * @note The reactor wakes up by itself when the pause is over. Meant to be called from a handler,
+ * 			as a reactor blocked in poll() only notices changes made from other threads on its next round.
+ */
+void pauseFd(void *react, int fd, uint64_t usec);
+
+/*
+ * @brief Resume polling a paused file descriptor.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to resume.
+ * @return void
+ */
+void resumeFd(void *react, int fd);
+
+/*
+ * @brief Set the events a file descriptor is polled for.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor.
+ * @param events The events, POLLIN and/or POLLOUT.
+ * @return void
+ * @note The handler is called when any of the events is ready, e.g. POLLOUT lets a handler
+ * 			wait until a socket can be written to, instead of blocking in send().
+ */
+void setFdEvents(void *react, int fd, short events);
+
+/*
+ * @brief Attach per-connection state to a file descriptor in the reactor.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor.
+ * @param ctx The state to attach, allocated with malloc(), or NULL.
+ * @return void
+ * @note The previous context of the file descriptor, if any, is freed.
+ * @note The reactor owns the context from now on, and frees it when the file descriptor is removed.
+ */
+void setFdContext(void *react, int fd, void *ctx);
+
+/*
+ * @brief Get the per-connection state of a file descriptor in the reactor.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor.
+ * @return The context attached with setFdContext(), or NULL if none.
+ */
+void *getFdContext(void *react, int fd);
+
 /*
  * @brief Wait for the reactor to finish.
  * @param react A pointer to the reactor object.
@@ -274,13 +845,121 @@ void WaitFor(void *react);
 
 
 /*
- * @brief A signal handler for SIGINT.
- * @note This function is called when the user presses CTRL+C.
- * 			It stops the reactor, closes all sockets and frees all memory,
- * 			Then, it exits the program.
- * @note This function is registered to SIGINT in main().
+ * @brief A signal handler for SIGINT and SIGALRM.
+ * @param sig The signal number.
+ * @note This function only requests a shutdown, and wakes the reactor up through the signal pipe,
+ * 			the shutdown itself is done by run_server(), outside of the signal context.
+ * @note This function is registered to SIGINT and SIGALRM in main().
+*/
+void signal_handler(int sig);
+
+/*
+ * @brief A signal handler for SIGUSR2 - hot restart.
+ * @param sig The signal number.
+ * @note This function only requests a hot restart, and wakes the reactor up through the signal pipe,
+ * 			the restart itself is done by run_server(), see hot_restart().
+ * @note This function is registered to SIGUSR2 in main().
+*/
+void restart_handler(int sig);
+
+/*
+ * @brief Handle the read end of the signal pipe - stop the reactor thread, so run_server() takes over.
+ * @param fd The read end of the signal pipe.
+ * @param react The reactor.
+ * @return The reactor.
+*/
+void *signal_pipe_handler(int fd, void *react);
+
+/*
+ * @brief Run the reactor until the server shuts down, handling the requests of the signal handlers
+ * 			between runs. Never returns.
+ * @note On a hot restart request the reactor is stopped, hot_restart() runs from the main thread,
+ * 			and the reactor is started again, unless the server was handed off completely.
+*/
+void run_server();
+
+/*
+ * @brief Shut the server down - close all sockets, free all memory, print the statistics and exit.
+ * @note A reactor that's still running is stopped first.
+*/
+void server_shutdown();
+
+/*
+ * @brief Hot restart - exec a new instance of the server, and hand it the listening sockets
+ * 			(and, if SERVER_HANDOFF_CLIENTS is set, the clients and their state) over a Unix socket,
+ * 			using SCM_RIGHTS.
+ * @note Called by run_server() with the reactor stopped. On failure, the service simply resumes.
+ * 			On success, it requests a shutdown, or starts draining the remaining clients.
+*/
+void hot_restart();
+
+/*
+ * @brief Send the reactor's file descriptors and their state to a new server process.
+ * @param sock The old process' end of the handoff socket.
+ * @param clients Whether to hand off the clients as well, or only the listeners.
+ * @param sent_clients Filled with the number of clients that were handed off.
+ * @return The number of listeners handed off on success, -1 otherwise.
+ * @note The reactor must be stopped before calling this function.
+ * @note Nothing is handed off until the new process acknowledges it, and tells whether it took the clients too.
+ * @note The clients are sent field by field, not as client_t, so a new binary with another layout doesn't misread them.
 */
-void signal_handler();
+int handoff_send(int sock, bool clients, uint32_t *sent_clients);
+
+/*
+ * @brief Receive file descriptors and their state from an old server process, and add them to the reactor.
+ * @param sock The new process' end of the handoff socket.
+ * @param took_clients Filled with whether the clients were taken over, and not only the listeners.
+ * @return The number of listeners received on success, -1 otherwise.
+ * @note The records start with a header - a magic, a version and the size of a record. When the old process
+ * 			runs another version, only its listeners are taken over, and it keeps draining its clients.
+*/
+int handoff_receive(int sock, bool *took_clients);
+
+/*
+ * @brief Attach the rate limits of a listener to its reactor node, so bucket_init() finds them by the listener fd.
+ * @param react The reactor.
+ * @param fd The listener file descriptor, already in the reactor.
+ * @param listener The listener, as found in SERVER_LISTENERS, or NULL for a listener without limits.
+ * @return void
+*/
+void attach_listener_limit(void *react, int fd, const listener_t *listener);
+
+/*
+ * @brief Find the listener in SERVER_LISTENERS a listening socket is bound to.
+ * @param fd The listening socket file descriptor.
+ * @return The listener, or NULL if the socket isn't bound to any of them.
+ * @note Matches the socket's address - its family, port and IP address, or its path - since the file
+ * 			descriptor of a listener changes across a hot restart.
+*/
+const listener_t *listener_find(int fd);
+
+/*
+ * @brief Initialize a client's token bucket with the limits of the listener that accepted it.
+ * @param bucket The token bucket.
+ * @param react The reactor.
+ * @param listener_fd The listener file descriptor.
+ * @return void
+*/
+void bucket_init(token_bucket_t_ptr bucket, void *react, int listener_fd);
+
+/*
+ * @brief Take tokens out of a client's bucket, and throttle the client if it ran out.
+ * @param client The client.
+ * @param react The reactor.
+ * @param fd The file descriptor to pause while the client is throttled.
+ * @param bytes The number of bytes the client sent.
+ * @return For how long the client is throttled, in microseconds, or 0 if it wasn't.
+ * @note A throttled client isn't read from until its bucket is refilled.
+*/
+uint64_t bucket_consume(client_t_ptr client, void *react, int fd, size_t bytes);
+
+/*
+ * @brief Create, bind and listen on a server socket.
+ * @param listener The listener, as found in SERVER_LISTENERS.
+ * @return The listening socket file descriptor on success, -1 otherwise.
+ * @note IPv4 and IPv6 sockets listen on SERVER_PORT.
+*/
+int create_listener(const listener_t *listener);
 
 /*
  * @brief A handler for a client socket.
@@ -293,8 +972,80 @@ void signal_handler();
 void *client_handler(int fd, void *react);
 
 /*
- * @brief A handler for the server socket.
- * @param fd The server socket file descriptor.
+ * @brief The coroutine that serves a client, when SERVER_COROUTINES is enabled.
+ * @param fd The client file descriptor.
+ * @param react The reactor.
+ * @param arg Unused.
+ * @return void
+ * @note The same as client_handler(), written as a loop - it never blocks the reactor,
+ * 			as co_read() and co_sleep() yield back to it instead.
+*/
+void client_coroutine(int fd, void *react, void *arg);
+
+/*
+ * @brief Handle a message received from a client - print it and relay it to the other clients.
+ * @param react The reactor.
+ * @param fd The file descriptor of the sender.
+ * @param client The per-connection state of the sender, or NULL.
+ * @param buf The message, in a buffer of MAX_BUFFER bytes.
+ * @param bytes_read The length of the message.
+ * @return true on success, false otherwise.
+*/
+bool handle_message(void *react, int fd, client_t_ptr client, char *buf, int bytes_read);
+
+/*
+ * @brief Relay a message to all the clients, except the sender.
+ * @param react The reactor.
+ * @param fd The file descriptor of the sender.
+ * @param msg The message to relay.
+ * @param len The length of the message.
+ * @return void
+ * @note A client that can't be sent to is skipped, and removed once its own handler sees the error.
+ * @note A client with a registered UDP endpoint is skipped too, it gets the message over UDP.
+ * @note Socket clients get the message with send(), shared-memory clients through their ring.
+ * @note Coroutine clients are non-blocking - when one is full, the rest of the message is sent once it has room,
+ * 			with the calling coroutine waiting for it, so the message isn't dropped.
+*/
+void relay_message(void *react, int fd, const char *msg, size_t len);
+
+/*
+ * @brief A handler for the shared-memory listening socket.
+ * @param fd The listening socket file descriptor.
+ * @param react The reactor.
+ * @return The reactor.
+ * @note Every accepted connection becomes the control socket of a new shared-memory session.
+*/
+void *shm_server_handler(int fd, void *react);
+
+/*
+ * @brief A handler for the control socket of a shared-memory session.
+ * @param fd The control socket file descriptor.
+ * @param react The reactor.
+ * @return The reactor on success, NULL when the client disconnected.
+*/
+void *shm_control_handler(int fd, void *react);
+
+/*
+ * @brief A handler for the server doorbell (eventfd) of a shared-memory session.
+ * @param fd The doorbell file descriptor.
+ * @param react The reactor.
+ * @return The reactor on success, NULL otherwise.
+ * @note Drains the client's ring, and handles every message as if it was received on a socket.
+*/
+void *shm_doorbell_handler(int fd, void *react);
+
+/*
+ * @brief Relay a message to a shared-memory client.
+ * @param session The shared-memory session.
+ * @param msg The message.
+ * @param len The length of the message.
+ * @return true on success, false if the client's ring is full.
+*/
+bool shm_session_send(shm_session_t_ptr session, const char *msg, size_t len);
+
+/*
+ * @brief A handler for the server listening sockets.
+ * @param fd The server listening socket file descriptor.
  * @param arg The reactor.
  * @return The reactor on success, NULL otherwise.
  * @note This function is called when a new client connects to the server,
@@ -302,4 +1053,43 @@ void *client_handler(int fd, void *react);
 */
 void *server_handler(int fd, void *react);
 
+/*
+ * @brief Accept a connection on a listener, unless the server is full.
+ * @param react The reactor.
+ * @param fd The listener file descriptor.
+ * @param addr The address of the client, or NULL.
+ * @param addr_len The length of the address, or NULL.
+ * @return The client file descriptor, or -1 if no client was admitted.
+ * @note When the server is full, or out of file descriptors, the pending connection is accepted and closed
+ * 			(through a reserved file descriptor), and the listeners are paused, so the reactor doesn't spin on them.
+*/
+int accept_client(void *react, int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+/*
+ * @brief Pause the listeners once the server is full, until enough clients leave (see SERVER_ADMIT_HYSTERESIS).
+ * @param react The reactor.
+ * @param clients The number of clients the server is serving, or is about to.
+ * @return void
+ * @note Called for every accepted client, and once the clients of an old process were taken over, as a new
+ * 			process may inherit more clients than it admits.
+*/
+void admission_check(void *react, uint32_t clients);
+
+/*
+ * @brief Close a client that left or failed - end its capture, forget its UDP endpoints, and free its admission slot.
+ * @param fd The client file descriptor.
+ * @param client The per-connection state of the client, or NULL.
+ * @return void
+ * @note Every path that drops a client node must call this function, or the client keeps its slot forever.
+*/
+void client_close(int fd, client_t_ptr client);
+
+/*
+ * @brief Update the server state after a client disconnected.
+ * @note When the server is draining after a hot restart, the last client to disconnect
+ * 			shuts the old process down.
+ * @note Resumes the listeners once enough clients left a full server.
+*/
+void client_disconnected();
+
 #endif
\ No newline at end of file
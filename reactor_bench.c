@@ -0,0 +1,753 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "reactor.h"
+#include "coroutine.h"
+#include "channel.h"
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * @brief The number of times each benchmark is repeated - the best run is reported.
+*/
+#define BENCH_REPEAT		3
+
+/*
+ * @brief A run longer than this, in nanoseconds, isn't repeated, as it's stable enough on its own.
+*/
+#define BENCH_LONG_RUN		1000000000ULL
+
+/*
+ * @brief The default regression threshold in compare mode, in percent.
+*/
+#define BENCH_THRESHOLD		20.0
+
+/*
+ * @brief How long the dispatch benchmark samples the reactor thread, in milliseconds.
+*/
+#define BENCH_DISPATCH_MS	200
+
+/*
+ * @brief The first fake file descriptor number used when renumbering nodes, far above any real one.
+*/
+#define BENCH_FAKE_FD_BASE	(1 << 24)
+
+/*
+ * @brief The maximum number of benchmark results.
+*/
+#define BENCH_MAX_RESULTS	64
+
+/*
+ * @brief A single benchmark result.
+*/
+typedef struct _bench_result
+{
+	// The benchmark name.
+	char name[32];
+
+	// The number of file descriptors or clients the benchmark ran with.
+	size_t n;
+
+	// The cost of a single operation, in nanoseconds.
+	double ns_per_op;
+
+	// Whether the baseline has the benchmark, set by bench_compare().
+	bool compared;
+} bench_result_t, *bench_result_t_ptr;
+
+// The benchmark results, in the order they ran.
+static bench_result_t results[BENCH_MAX_RESULTS];
+
+// The number of benchmark results.
+static size_t results_count = 0;
+
+// The number of handler calls in the dispatch benchmark.
+static atomic_ulong dispatch_count = 0;
+
+// The stream the results are written to - stdout is silenced, as the reactor logs every call there.
+static FILE *out = NULL;
+
+/*
+ * @brief Get the current time of the monotonic clock, in nanoseconds.
+ * @return The current time, in nanoseconds.
+*/
+static uint64_t bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * @brief Record the best of the repeated runs of a benchmark.
+ * @param name The benchmark name.
+ * @param n The number of file descriptors or clients.
+ * @param ns_per_op The cost of a single operation, in nanoseconds.
+*/
+static void bench_record(const char *name, size_t n, double ns_per_op) {
+	for (size_t i = 0; i < results_count; ++i)
+	{
+		if (strcmp(results[i].name, name) == 0 && results[i].n == n)
+		{
+			if (ns_per_op < results[i].ns_per_op)
+				results[i].ns_per_op = ns_per_op;
+
+			return;
+		}
+	}
+
+	if (results_count == BENCH_MAX_RESULTS)
+		return;
+
+	strncpy(results[results_count].name, name, sizeof(results[results_count].name) - 1);
+	results[results_count].n = n;
+	results[results_count].ns_per_op = ns_per_op;
+	results_count++;
+}
+
+/*
+ * @brief Free a reactor and all of its nodes, without closing anything.
+ * @param reactor The reactor.
+*/
+static void bench_destroy(reactor_t_ptr reactor) {
+	reactor_node_ptr curr = reactor->head;
+
+	while (curr != NULL)
+	{
+		reactor_node_ptr next = curr->next;
+
+		free(curr->ctx);
+		free(curr);
+		curr = next;
+	}
+
+	free(reactor->fds);
+	free(reactor);
+}
+
+/*
+ * @brief A handler that's never called.
+*/
+static void *bench_nop_handler(int fd, void *react) {
+	(void)fd;
+	return react;
+}
+
+/*
+ * @brief A handler that counts its calls, and leaves the file descriptor readable.
+*/
+static void *bench_count_handler(int fd, void *react) {
+	(void)fd;
+	atomic_fetch_add_explicit(&dispatch_count, 1, memory_order_relaxed);
+	return react;
+}
+
+/*
+ * @brief Fill a reactor with n nodes, with distinct fake file descriptor numbers.
+ * @param reactor The reactor.
+ * @param n The number of nodes.
+ * @note The list is built directly rather than with addFd(), so the setup doesn't dominate the run.
+ * @note The fake numbers are never polled, they only keep lookups by file descriptor honest.
+*/
+static void bench_fill(reactor_t_ptr reactor, size_t n) {
+	reactor_node_ptr tail = NULL;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		reactor_node_ptr node = (reactor_node_ptr)calloc(1, sizeof(reactor_node));
+
+		if (node == NULL)
+			return;
+
+		node->fd = BENCH_FAKE_FD_BASE + (int)i;
+		node->type = FD_TYPE_CLIENT;
+		node->hdlr.handler = bench_nop_handler;
+
+		if (tail == NULL)
+			reactor->head = node;
+
+		else
+			tail->next = node;
+
+		tail = node;
+	}
+}
+
+/*
+ * @brief Benchmark addFd() - appending n file descriptors to an empty reactor.
+ * @param n The number of file descriptors.
+*/
+static void bench_add(size_t n) {
+	int fd = eventfd(0, 0);
+
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+
+		uint64_t start = bench_now();
+
+		for (size_t i = 0; i < n; ++i)
+			addFd(reactor, fd, bench_nop_handler);
+
+		uint64_t elapsed = bench_now() - start;
+
+		bench_record("add", n, (double)elapsed / n);
+		bench_destroy(reactor);
+
+		if (elapsed > BENCH_LONG_RUN)
+			break;
+	}
+
+	close(fd);
+}
+
+/*
+ * @brief Benchmark removeFd() - removing all n file descriptors, in a shuffled order.
+ * @param n The number of file descriptors.
+*/
+static void bench_remove(size_t n) {
+	int *order = (int *)malloc(n * sizeof(int));
+
+	if (order == NULL)
+		return;
+
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+
+		bench_fill(reactor, n);
+
+		// A fixed seed, so every run removes in the same order.
+		srand(n);
+
+		for (size_t i = 0; i < n; ++i)
+			order[i] = BENCH_FAKE_FD_BASE + (int)i;
+
+		for (size_t i = n - 1; i > 0; --i)
+		{
+			size_t j = (size_t)rand() % (i + 1);
+			int tmp = order[i];
+
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		uint64_t start = bench_now();
+
+		for (size_t i = 0; i < n; ++i)
+			removeFd(reactor, order[i]);
+
+		uint64_t elapsed = bench_now() - start;
+
+		bench_record("remove", n, (double)elapsed / n);
+		bench_destroy(reactor);
+
+		if (elapsed > BENCH_LONG_RUN)
+			break;
+	}
+
+	free(order);
+}
+
+/*
+ * @brief Benchmark the dispatch in reactorRun() - the cost per ready file descriptor.
+ * @param n The number of file descriptors, all of them always ready.
+ * @note Every eventfd is left readable, so every round of the reactor dispatches all of them,
+ * 			including the poll() call and the poll array rebuild, amortized over n.
+*/
+static void bench_dispatch(size_t n) {
+	int *fds = (int *)calloc(n, sizeof(int));
+	uint64_t one = 1;
+
+	if (fds == NULL)
+		return;
+
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			fds[i] = eventfd(0, 0);
+
+			if (fds[i] < 0 || write(fds[i], &one, sizeof(one)) != sizeof(one))
+			{
+				fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+				n = i;
+				break;
+			}
+
+			addFd(reactor, fds[i], bench_count_handler);
+		}
+
+		if (n == 0)
+		{
+			bench_destroy(reactor);
+			break;
+		}
+
+		startReactor(reactor);
+
+		// Let the reactor thread warm up, then sample it.
+		struct timespec warmup = { .tv_sec = 0, .tv_nsec = 20 * 1000000L };
+		struct timespec sample = { .tv_sec = 0, .tv_nsec = BENCH_DISPATCH_MS * 1000000L };
+
+		nanosleep(&warmup, NULL);
+
+		unsigned long count = atomic_load(&dispatch_count);
+		uint64_t start = bench_now();
+
+		nanosleep(&sample, NULL);
+
+		unsigned long calls = atomic_load(&dispatch_count) - count;
+		uint64_t elapsed = bench_now() - start;
+
+		stopReactor(reactor);
+
+		if (calls > 0)
+			bench_record("dispatch", n, (double)elapsed / calls);
+
+		for (size_t i = 0; i < n; ++i)
+			close(fds[i]);
+
+		bench_destroy(reactor);
+	}
+
+	free(fds);
+}
+
+/*
+ * @brief Benchmark the relay fan-out of client_handler() - one message from one client to all the others.
+ * @param n The number of connected clients, including the sender.
+ * @param rounds The number of messages to relay.
+*/
+static void bench_relay(size_t n, size_t rounds) {
+	int (*pairs)[2] = calloc(n, sizeof(*pairs));
+	char msg[64], drain[MAX_BUFFER + SERVER_RLY_MSG_LEN];
+
+	if (pairs == NULL)
+		return;
+
+	memset(msg, 'x', sizeof(msg));
+
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+		uint64_t elapsed = 0;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) < 0)
+			{
+				fprintf(stderr, "socketpair() failed: %s\n", strerror(errno));
+				n = i;
+				break;
+			}
+
+			addFd(reactor, pairs[i][0], client_handler);
+			setFdContext(reactor, pairs[i][0], calloc(1, sizeof(client_t)));
+		}
+
+		if (n < 2)
+		{
+			bench_destroy(reactor);
+			break;
+		}
+
+		for (size_t k = 0; k < rounds; ++k)
+		{
+			if (write(pairs[0][1], msg, sizeof(msg)) != sizeof(msg))
+				break;
+
+			uint64_t start = bench_now();
+
+			client_handler(pairs[0][0], reactor);
+
+			elapsed += bench_now() - start;
+
+			// Keep the socket buffers from filling up, outside of the measurement.
+			for (size_t i = 1; i < n; ++i)
+				while (recv(pairs[i][1], drain, sizeof(drain), MSG_DONTWAIT) > 0);
+		}
+
+		bench_record("relay", n, (double)elapsed / rounds);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			close(pairs[i][0]);
+			close(pairs[i][1]);
+		}
+
+		bench_destroy(reactor);
+	}
+
+	free(pairs);
+}
+
+/*
+ * @brief The body of the benchmarked coroutines - reads one byte at a time, forever.
+*/
+static void bench_co_reader(int fd, void *react, void *arg) {
+	char byte = 0;
+
+	(void)react;
+	(void)arg;
+
+	while (co_read(fd, &byte, 1) > 0);
+}
+
+/*
+ * @brief Benchmark a coroutine wake-up - resume, read, yield on EAGAIN - with n live coroutines.
+ * @param n The number of coroutines.
+ * @param rounds The number of wake-ups.
+*/
+static void bench_coroutine(size_t n, size_t rounds) {
+	int (*pairs)[2] = calloc(n, sizeof(*pairs));
+
+	if (pairs == NULL)
+		return;
+
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+		uint64_t elapsed = 0;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) < 0 || co_spawn(reactor, pairs[i][0], bench_co_reader, NULL) < 0)
+			{
+				fprintf(stderr, "co_spawn() failed: %s\n", strerror(errno));
+				n = i;
+				break;
+			}
+		}
+
+		// The last coroutine is the one that's woken up, so its lookup walks the whole list.
+		reactor_node_ptr node = reactor->head;
+
+		while (node != NULL && node->next != NULL)
+			node = node->next;
+
+		for (size_t k = 0; node != NULL && k < rounds; ++k)
+		{
+			if (write(pairs[n - 1][1], "x", 1) != 1)
+				break;
+
+			uint64_t start = bench_now();
+
+			node->hdlr.handler(node->fd, reactor);
+
+			elapsed += bench_now() - start;
+		}
+
+		if (node != NULL)
+			bench_record("coroutine", n, (double)elapsed / rounds);
+
+		// Removing the file descriptors releases their coroutines.
+		for (size_t i = 0; i < n; ++i)
+		{
+			removeFd(reactor, pairs[i][0]);
+			close(pairs[i][0]);
+			close(pairs[i][1]);
+		}
+
+		bench_destroy(reactor);
+	}
+
+	free(pairs);
+}
+
+/*
+ * @brief The body of the coroutine of the switch benchmark - yields back to the reactor, forever.
+*/
+static void bench_co_yield(int fd, void *react, void *arg) {
+	(void)react;
+	(void)arg;
+
+	while (co_wait(fd, POLLIN) == 0);
+}
+
+/*
+ * @brief Benchmark a bare coroutine switch - resume and yield back, without any I/O.
+ * @param rounds The number of round trips.
+ * @note The cost of the context switch itself, see CO_FAST_SWITCH - with swapcontext(), both switches of a round trip
+ * 			also make a system call, to save and restore the signal mask.
+*/
+static void bench_co_switch(size_t rounds) {
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+		int pair[2] = { -1, -1 };
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || co_spawn(reactor, pair[0], bench_co_yield, NULL) < 0)
+		{
+			fprintf(stderr, "co_spawn() failed: %s\n", strerror(errno));
+			bench_destroy(reactor);
+			break;
+		}
+
+		// The first resume starts the coroutine, the rest go straight back to its co_wait().
+		reactor->head->hdlr.handler(pair[0], reactor);
+
+		uint64_t start = bench_now();
+
+		for (size_t k = 0; k < rounds; ++k)
+			reactor->head->hdlr.handler(pair[0], reactor);
+
+		bench_record("co_switch", 1, (double)(bench_now() - start) / rounds);
+
+		removeFd(reactor, pair[0]);
+		close(pair[0]);
+		close(pair[1]);
+		bench_destroy(reactor);
+	}
+}
+
+/*
+ * @brief The handler of the benchmarked channel - counts the messages.
+*/
+static void bench_channel_handler(channel_msg_t_ptr msg, void *react) {
+	(void)msg;
+	(void)react;
+	atomic_fetch_add_explicit(&dispatch_count, 1, memory_order_relaxed);
+}
+
+/*
+ * @brief Benchmark a channel between two threads - the cost per message, wakeup included.
+ * @param burst The number of messages sent at once, before waiting for the receiving reactor to handle them.
+ * @param total The number of messages to send.
+ * @note The same message is sent over and over, the channel only passes references to it.
+*/
+static void bench_channel(size_t burst, size_t total) {
+	for (int r = 0; r < BENCH_REPEAT; ++r)
+	{
+		reactor_t_ptr reactor = (reactor_t_ptr)createReactor();
+		void *channel = createChannel(reactor, bench_channel_handler);
+		channel_msg_t_ptr msg = channelMsgCreate("benchmark", 9, -1);
+
+		if (channel == NULL || msg == NULL)
+		{
+			channelMsgRelease(msg);
+			bench_destroy(reactor);
+			break;
+		}
+
+		startReactor(reactor);
+
+		unsigned long base = atomic_load(&dispatch_count);
+		uint64_t start = bench_now();
+		size_t sent = 0;
+
+		while (sent < total)
+		{
+			for (size_t b = 0; b < burst && sent < total; ++b, ++sent)
+			{
+				while (!channelSend(channel, msg))
+				{
+					channelFlush(channel);
+					sched_yield();
+				}
+			}
+
+			channelFlush(channel);
+
+			while (atomic_load(&dispatch_count) - base < sent)
+				sched_yield();
+		}
+
+		uint64_t elapsed = bench_now() - start;
+
+		stopReactor(reactor);
+
+		bench_record("channel", burst, (double)elapsed / total);
+
+		destroyChannel(reactor, channel);
+		channelMsgRelease(msg);
+		bench_destroy(reactor);
+	}
+}
+
+/*
+ * @brief Compare the results against a saved baseline.
+ * @param path The path of the baseline, as written by a previous run.
+ * @param threshold The regression threshold, in percent.
+ * @return The number of regressions and missing benchmarks, or -1 if the baseline couldn't be read.
+ * @note A benchmark that is only in the baseline, or only in the results, is reported as MISSING - a comparison
+ * 			that silently covers less than the baseline doesn't pass.
+*/
+static int bench_compare(const char *path, double threshold) {
+	FILE *baseline = fopen(path, "r");
+	char line[128], name[32];
+	size_t n = 0;
+	double ns_per_op = 0;
+	int regressions = 0;
+	bool found = false;
+
+	if (baseline == NULL)
+	{
+		fprintf(stderr, "fopen(%s) failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(out, "benchmark,n,baseline_ns_per_op,ns_per_op,delta_percent,status\n");
+
+	while (fgets(line, sizeof(line), baseline) != NULL)
+	{
+		if (sscanf(line, "%31[^,],%zu,%lf", name, &n, &ns_per_op) != 3)
+			continue;
+
+		found = false;
+
+		for (size_t i = 0; i < results_count; ++i)
+		{
+			if (strcmp(results[i].name, name) != 0 || results[i].n != n)
+				continue;
+
+			found = true;
+			results[i].compared = true;
+
+			double delta = (ns_per_op > 0 ? (results[i].ns_per_op - ns_per_op) * 100.0 / ns_per_op : 0.0);
+			bool regressed = (delta > threshold);
+
+			fprintf(out, "%s,%zu,%.1f,%.1f,%+.1f,%s\n", name, n, ns_per_op, results[i].ns_per_op, delta, (regressed ? "REGRESSION" : "ok"));
+
+			regressions += regressed;
+		}
+
+		if (!found)
+		{
+			fprintf(out, "%s,%zu,%.1f,,,MISSING\n", name, n, ns_per_op);
+			regressions++;
+		}
+	}
+
+	fclose(baseline);
+
+	for (size_t i = 0; i < results_count; ++i)
+	{
+		if (!results[i].compared)
+		{
+			fprintf(out, "%s,%zu,,%.1f,,MISSING\n", results[i].name, results[i].n, results[i].ns_per_op);
+			regressions++;
+		}
+	}
+
+	return regressions;
+}
+
+int main(int argc, char *argv[]) {
+	const char *baseline = NULL;
+	double threshold = BENCH_THRESHOLD;
+	struct rlimit limit;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':
+				baseline = optarg;
+				break;
+
+			case 't':
+				threshold = atof(optarg);
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-c baseline.csv] [-t threshold_percent]\n", argv[0]);
+				fprintf(stderr, "\tWithout -c, prints the results as CSV (benchmark,n,ns_per_op), to be saved as a baseline.\n");
+				fprintf(stderr, "\tWith -c, compares against the baseline, and fails if anything is slower by more than the threshold (default %.0f%%).\n", BENCH_THRESHOLD);
+				return EXIT_FAILURE;
+		}
+	}
+
+	// The reactor logs every call to stdout, so the results go to a copy of it, and stdout goes to /dev/null.
+	int out_fd = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+
+	if (out_fd < 0 || null_fd < 0 || (out = fdopen(out_fd, "w")) == NULL)
+	{
+		fprintf(stderr, "Failed to redirect stdout: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	// The dispatch and relay benchmarks need real file descriptors.
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	const size_t list_sizes[] = { 1000, 10000, 100000 };
+	const size_t dispatch_sizes[] = { 16, 256, 1024, 4096 };
+	const size_t relay_sizes[] = { 2, 16, 128, 1024 };
+	const size_t coroutine_sizes[] = { 1, 1024 };
+	const size_t channel_bursts[] = { 1, 16, 256 };
+
+	for (size_t i = 0; i < sizeof(list_sizes) / sizeof(list_sizes[0]); ++i)
+	{
+		bench_add(list_sizes[i]);
+		bench_remove(list_sizes[i]);
+	}
+
+	for (size_t i = 0; i < sizeof(dispatch_sizes) / sizeof(dispatch_sizes[0]); ++i)
+		bench_dispatch(dispatch_sizes[i]);
+
+	for (size_t i = 0; i < sizeof(relay_sizes) / sizeof(relay_sizes[0]); ++i)
+		bench_relay(relay_sizes[i], 2000);
+
+	for (size_t i = 0; i < sizeof(coroutine_sizes) / sizeof(coroutine_sizes[0]); ++i)
+		bench_coroutine(coroutine_sizes[i], 20000);
+
+	bench_co_switch(1000000);
+
+	for (size_t i = 0; i < sizeof(channel_bursts) / sizeof(channel_bursts[0]); ++i)
+		bench_channel(channel_bursts[i], 50000);
+
+	if (baseline != NULL)
+	{
+		int regressions = bench_compare(baseline, threshold);
+
+		fclose(out);
+
+		return (regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	fprintf(out, "benchmark,n,ns_per_op\n");
+
+	for (size_t i = 0; i < results_count; ++i)
+		fprintf(out, "%s,%zu,%.1f\n", results[i].name, results[i].n, results[i].ns_per_op);
+
+	fclose(out);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,866 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "reactor.h"
+#include "coroutine.h"
+#include "channel.h"
+#include "shm_ring.h"
+#include "msg_log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * @brief How long a test waits for the reactor thread to get something done, in milliseconds.
+*/
+#define TEST_TIMEOUT_MS		2000
+
+/*
+ * @brief The directory of the message log test, emptied before and after the test.
+*/
+#define TEST_LOG_DIR		"/tmp/reactor_test_log"
+
+/*
+ * @brief The path of the listening socket of the admission test.
+*/
+#define TEST_SOCKET_PATH	"/tmp/reactor_test.sock"
+
+// The reactor pointer, shared with the server's handlers.
+extern void *reactor;
+
+// The number of clients currently connected to the server.
+extern uint32_t active_clients;
+
+// The number of clients connected to the server in its lifetime.
+extern uint32_t client_count;
+
+// A file descriptor kept in reserve for when the process runs out of them, see accept_client().
+extern int reserve_fd;
+
+// Whether the listeners are paused because the server is full.
+extern bool admission_paused;
+
+// The number of clients at which paused listeners are resumed.
+extern uint32_t admission_resume;
+
+// The number of failed tests.
+static int failures = 0;
+
+// The number of messages the channel test received.
+static atomic_size_t channel_received = 0;
+
+// The stream the results are written to - stdout is silenced, as the reactor logs every call there.
+static FILE *out = NULL;
+
+/*
+ * @brief Sleep for a while.
+ * @param ms For how long, in milliseconds.
+*/
+static void test_sleep(long ms) {
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * @brief Report the result of a test.
+ * @param name The test name.
+ * @param ok Whether the test passed.
+ * @param reason Why the test failed, ignored if it passed.
+*/
+static void test_report(const char *name, bool ok, const char *reason) {
+	if (ok)
+		fprintf(out, "PASS %s\n", name);
+
+	else
+	{
+		fprintf(out, "FAIL %s: %s\n", name, reason);
+		failures++;
+	}
+}
+
+/*
+ * @brief Remove the files in a directory, then the directory itself.
+ * @param dir The directory.
+ * @return The number of files removed.
+*/
+static int test_remove_dir(const char *dir) {
+	char path[512];
+	struct dirent *entry = NULL;
+	DIR *d = opendir(dir);
+	int removed = 0;
+
+	if (d == NULL)
+		return 0;
+
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+		if (unlink(path) == 0)
+			removed++;
+	}
+
+	closedir(d);
+	rmdir(dir);
+
+	return removed;
+}
+
+/*
+ * @brief Get the current time of the monotonic clock.
+ * @return The current time, in milliseconds.
+*/
+static uint64_t test_now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * @brief Find the node of a file descriptor in the server's reactor.
+ * @param fd The file descriptor.
+ * @return The node, or NULL if it isn't in the reactor.
+*/
+static reactor_node_ptr test_node(int fd) {
+	for (reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head; curr != NULL; curr = curr->next)
+	{
+		if (curr->fd == fd)
+			return curr;
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Connect to the listening socket of the admission test.
+ * @return The connected socket, or -1 on failure.
+*/
+static int test_connect() {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	strncpy(addr.sun_path, TEST_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * @brief Check whether the server closed a connection it accepted.
+ * @param fd The client's end of the connection.
+ * @return true if it did, false otherwise.
+*/
+static bool test_refused(int fd) {
+	char c = 0;
+
+	return (fd >= 0 && recv(fd, &c, 1, MSG_DONTWAIT) == 0);
+}
+
+/*
+ * @brief Create the server's reactor, with nothing in it.
+ * @return true on success, false otherwise.
+*/
+static bool test_setup() {
+	active_clients = 0;
+	reactor = createReactor();
+
+	return (reactor != NULL);
+}
+
+/*
+ * @brief Stop the server's reactor, and free it and all of its nodes, closing their file descriptors.
+*/
+static void test_teardown() {
+	if (((reactor_t_ptr)reactor)->running)
+		stopReactor(reactor);
+
+	// Removing the file descriptors cancels their coroutines, which close their own.
+	while (((reactor_t_ptr)reactor)->head != NULL)
+	{
+		int fd = ((reactor_t_ptr)reactor)->head->fd;
+
+		removeFd(reactor, fd);
+
+		if (fcntl(fd, F_GETFD) >= 0)
+			close(fd);
+	}
+
+	free(((reactor_t_ptr)reactor)->fds);
+	free(reactor);
+	reactor = NULL;
+}
+
+/*
+ * @brief Add a coroutine client to the server's reactor, like server_handler() does.
+ * @param fd The server's end of the client's connection.
+ * @param id The client reference ID.
+ * @return true on success, false otherwise.
+*/
+static bool test_add_client(int fd, uint32_t id) {
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t));
+
+	if (client == NULL || co_spawn(reactor, fd, client_coroutine, NULL) < 0)
+	{
+		free(client);
+		return false;
+	}
+
+	client->id = id;
+	setFdContext(reactor, fd, client);
+	active_clients++;
+
+	return true;
+}
+
+/*
+ * @brief A coroutine client that hangs up without sending anything is closed and accounted for.
+ * @note The read end of a pipe whose write end is closed reports POLLHUP alone, without POLLIN.
+*/
+static void test_coroutine_hangup() {
+	int pipe_fds[2] = { -1, -1 };
+
+	if (!test_setup() || pipe(pipe_fds) < 0 || !test_add_client(pipe_fds[0], 1))
+	{
+		test_report("coroutine_hangup", false, strerror(errno));
+		return;
+	}
+
+	startReactor(reactor);
+	test_sleep(50);
+	close(pipe_fds[1]);
+
+	for (int waited = 0; active_clients > 0 && waited < TEST_TIMEOUT_MS; waited += 10)
+		test_sleep(10);
+
+	bool closed = (fcntl(pipe_fds[0], F_GETFD) < 0 && errno == EBADF);
+
+	test_report("coroutine_hangup", active_clients == 0 && closed && ((reactor_t_ptr)reactor)->head == NULL,
+				(active_clients > 0 ? "the client is still counted as active" : "the client's file descriptor was leaked"));
+
+	test_teardown();
+}
+
+/*
+ * @brief A message relayed to a coroutine client whose socket is full is sent once it has room, not dropped.
+*/
+static void test_coroutine_relay_full() {
+	int sender[2] = { -1, -1 }, peer[2] = { -1, -1 }, size = 4096;
+	char junk[4096], buf[MAX_BUFFER + SERVER_RLY_MSG_LEN];
+	const char *expected = "Message from client 1: hello";
+	size_t junk_len = 0, received = 0;
+	bool found = false;
+
+	if (!test_setup() || socketpair(AF_UNIX, SOCK_STREAM, 0, sender) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, peer) < 0 ||
+		!test_add_client(sender[0], 1) || !test_add_client(peer[0], 2))
+	{
+		test_report("coroutine_relay_full", false, strerror(errno));
+		return;
+	}
+
+	// Fill the peer's socket up, so the relay to it gets EAGAIN - co_spawn() made it non-blocking.
+	setsockopt(peer[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	memset(junk, 'x', sizeof(junk));
+
+	for (ssize_t ret = 0; (ret = send(peer[0], junk, sizeof(junk), 0)) > 0; )
+		junk_len += (size_t)ret;
+
+	startReactor(reactor);
+
+	if (write(sender[1], "hello", 5) != 5)
+	{
+		test_report("coroutine_relay_full", false, strerror(errno));
+		test_teardown();
+		return;
+	}
+
+	// Let the relay hit the full socket, then read everything - the message must come whole, right after the junk.
+	test_sleep(100);
+
+	char *all = (char *)malloc(junk_len + sizeof(buf));
+
+	for (int waited = 0; all != NULL && received < junk_len + strlen(expected) && waited < TEST_TIMEOUT_MS; waited += 10)
+	{
+		ssize_t ret = 0;
+
+		while (received < junk_len + strlen(expected) && (ret = recv(peer[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		{
+			size_t len = ((size_t)ret < junk_len + sizeof(buf) - received ? (size_t)ret : junk_len + sizeof(buf) - received);
+
+			memcpy(all + received, buf, len);
+			received += len;
+		}
+
+		test_sleep(10);
+	}
+
+	found = (all != NULL && received >= junk_len + strlen(expected) && memcmp(all + junk_len, expected, strlen(expected)) == 0);
+	free(all);
+
+	test_report("coroutine_relay_full", found, "the relayed message was dropped");
+
+	close(sender[1]);
+	close(peer[1]);
+	test_teardown();
+}
+
+/*
+ * @brief A suspended coroutine client whose file descriptor is removed is cancelled - it closes the client and frees its slot.
+*/
+static void test_coroutine_cancel() {
+	int pair[2] = { -1, -1 };
+
+	if (!test_setup() || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || !test_add_client(pair[0], 1))
+	{
+		test_report("coroutine_cancel", false, strerror(errno));
+		return;
+	}
+
+	// Let the coroutine start, and suspend in co_read().
+	startReactor(reactor);
+	test_sleep(50);
+	stopReactor(reactor);
+
+	removeFd(reactor, pair[0]);
+
+	bool closed = (fcntl(pair[0], F_GETFD) < 0 && errno == EBADF);
+
+	test_report("coroutine_cancel", active_clients == 0 && closed,
+				(active_clients > 0 ? "the client is still counted as active" : "the client's file descriptor was leaked"));
+
+	close(pair[1]);
+	test_teardown();
+}
+
+/*
+ * @brief The handler of the channel test - counts the messages.
+ * @param msg The message.
+ * @param react The receiving reactor.
+*/
+static void test_channel_handler(channel_msg_t_ptr msg, void *react) {
+	(void)msg;
+	(void)react;
+
+	atomic_fetch_add_explicit(&channel_received, 1, memory_order_relaxed);
+}
+
+/*
+ * @brief A producer that never waits for the receiving reactor gets all of its messages through, and only
+ * 			wakes it up when it went idle - not once per flush.
+*/
+static void test_channel_wakeups() {
+	const size_t total = 200000;
+	size_t flushes = 0;
+
+	if (!test_setup())
+	{
+		test_report("channel_wakeups", false, "setup failed");
+		return;
+	}
+
+	channel_t_ptr channel = (channel_t_ptr)createChannel(reactor, test_channel_handler);
+	channel_msg_t_ptr msg = channelMsgCreate("test", 4, -1);
+
+	if (channel == NULL || msg == NULL)
+	{
+		channelMsgRelease(msg);
+		test_report("channel_wakeups", false, "setup failed");
+		test_teardown();
+		return;
+	}
+
+	atomic_store(&channel_received, 0);
+	startReactor(reactor);
+
+	// Bursts of varying sizes, each one flushed, so the receiving reactor is caught both idle and in the middle of a batch.
+	for (size_t sent = 0; sent < total; ++flushes)
+	{
+		for (size_t b = 0; b <= flushes % 37 && sent < total; ++b, ++sent)
+		{
+			while (!channelSend(channel, msg))
+				channelFlush(channel);
+		}
+
+		channelFlush(channel);
+	}
+
+	for (int waited = 0; atomic_load(&channel_received) < total && waited < TEST_TIMEOUT_MS; waited += 10)
+		test_sleep(10);
+
+	stopReactor(reactor);
+
+	if (atomic_load(&channel_received) < total)
+		test_report("channel_wakeups", false, "messages were left in the channel, a wakeup was lost");
+
+	else
+		test_report("channel_wakeups", channel->wakeups < flushes, "the receiving reactor was woken up on every flush");
+
+	destroyChannel(reactor, channel);
+	channelMsgRelease(msg);
+	test_teardown();
+}
+
+/*
+ * @brief Messages that wrap around the end of a shared-memory ring, and around its free-running counters, come out whole,
+ * 			and a full ring refuses a message until one is popped.
+*/
+static void test_shm_ring_wrap() {
+	shm_ring_t_ptr ring = (shm_ring_t_ptr)calloc(1, sizeof(shm_ring_t));
+	char msg[1000], buf[1000];
+	uint32_t count = 0, last = 0, popped = 0;
+	bool wake = false, ok = true;
+	int len = 0;
+
+	if (ring == NULL)
+	{
+		test_report("shm_ring_wrap", false, strerror(errno));
+		return;
+	}
+
+	// Start 2 bytes before the end of the data and of the counters, so even the length prefix is split in two.
+	atomic_store(&ring->head, UINT32_MAX - 1);
+	atomic_store(&ring->tail, UINT32_MAX - 1);
+
+	for (int i = 0; i < 3 && ok; ++i)
+	{
+		memset(msg, 'a' + i, sizeof(msg));
+
+		ok = (shm_ring_push(ring, msg, sizeof(msg), &wake) && wake && shm_ring_pop(ring, buf, sizeof(buf)) == (int)sizeof(msg) &&
+				memcmp(buf, msg, sizeof(msg)) == 0);
+	}
+
+	if (!ok)
+	{
+		test_report("shm_ring_wrap", false, "a message that wrapped around came out different");
+		free(ring);
+		return;
+	}
+
+	// Fill it up - the message that takes the last free bytes still fits, and then not even an empty one does.
+	for (memset(msg, 0, sizeof(msg)); shm_ring_push(ring, msg, sizeof(msg), &wake); msg[0] = (char)++count)
+		ok = (ok && wake == (count == 0));
+
+	last = SHM_RING_SIZE - count * (uint32_t)(sizeof(uint32_t) + sizeof(msg)) - sizeof(uint32_t);
+
+	if (!ok || count != SHM_RING_SIZE / (sizeof(uint32_t) + sizeof(msg)) || !shm_ring_push(ring, msg, last, NULL) || shm_ring_push(ring, msg, 0, NULL))
+	{
+		test_report("shm_ring_wrap", false, "the ring didn't fill up to the last byte");
+		free(ring);
+		return;
+	}
+
+	// Make room for one more, then drain it all, in order.
+	ok = (shm_ring_pop(ring, buf, sizeof(buf)) == (int)sizeof(msg) && buf[0] == 0);
+	msg[0] = (char)(count + 1);
+	ok = (ok && shm_ring_push(ring, msg, sizeof(msg), &wake) && !wake);
+
+	for (popped = 1; ok && (len = shm_ring_pop(ring, buf, sizeof(buf))) >= 0; ++popped)
+		ok = (buf[0] == (char)popped && len == (int)(popped == count ? last : sizeof(msg)));
+
+	test_report("shm_ring_wrap", ok && popped == count + 2, "messages were lost or reordered in a full ring");
+
+	free(ring);
+}
+
+/*
+ * @brief A full log segment rolls over to a new one, and a replay that starts in the old segment goes on into the new one.
+*/
+static void test_log_rollover() {
+	const uint32_t total = LOG_SEGMENT_RECORDS + 10, replayed = 20;
+	char msg[32], expected[32 * 20], buf[32 * 20 + 1];
+	size_t expected_len = 0, received = 0;
+	int pair[2] = { -1, -1 };
+
+	test_remove_dir(TEST_LOG_DIR);
+
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t));
+
+	if (client == NULL || !test_setup() || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || log_open(TEST_LOG_DIR) < 0)
+	{
+		test_report("log_rollover", false, strerror(errno));
+		free(client);
+		return;
+	}
+
+	// The last 20 messages - the first 10 in the full segment, the others in the new one.
+	for (uint32_t i = 0; i < total; ++i)
+	{
+		int len = snprintf(msg, sizeof(msg), "message %u\n", i);
+
+		log_append(1, msg, (size_t)len);
+
+		if (i >= total - replayed)
+		{
+			memcpy(expected + expected_len, msg, (size_t)len);
+			expected_len += (size_t)len;
+		}
+	}
+
+	client->id = 2;
+
+	bool request = log_handle_request(reactor, pair[0], client, "/last 20");
+
+	for (int waited = 0; received < expected_len && waited < TEST_TIMEOUT_MS; waited += 10)
+	{
+		ssize_t ret = recv(pair[1], buf + received, sizeof(buf) - 1 - received, MSG_DONTWAIT);
+
+		if (ret > 0)
+			received += (size_t)ret;
+
+		else
+			test_sleep(10);
+	}
+
+	log_close();
+
+	// Each segment is a data file and a record table.
+	int files = test_remove_dir(TEST_LOG_DIR);
+
+	if (!request || files != 4)
+		test_report("log_rollover", false, (!request ? "the replay request wasn't recognized" : "the log didn't roll over to a second segment"));
+
+	else
+		test_report("log_rollover", received == expected_len && memcmp(buf, expected, expected_len) == 0 && !client->replay.active,
+					"the replay didn't go on from the full segment into the new one");
+
+	close(pair[0]);
+	close(pair[1]);
+	free(client);
+	test_teardown();
+}
+
+/*
+ * @brief A client gets the limits of the listener that accepted it, is throttled once its burst is used up, for as long as
+ * 			its bucket takes to pay the debt back, and is resumed by the reactor then. An idle bucket refills up to a burst, not more.
+*/
+static void test_rate_limit() {
+	const listener_t listener = { "test", AF_UNIX, NULL, true, server_handler, { 0, 10 } };
+	const uint32_t burst = 10 * SERVER_RATE_BURST_MS / 1000;
+	int listener_pair[2] = { -1, -1 }, pair[2] = { -1, -1 };
+	uint64_t wait = 0, throttled = 0, started = 0, resumed = 0;
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t));
+
+	if (client == NULL || !test_setup() || socketpair(AF_UNIX, SOCK_STREAM, 0, listener_pair) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+	{
+		test_report("rate_limit", false, strerror(errno));
+		free(client);
+		return;
+	}
+
+	// The listener never becomes readable, it only carries the limits.
+	addListener(reactor, listener_pair[0], server_handler);
+	attach_listener_limit(reactor, listener_pair[0], &listener);
+	addFd(reactor, pair[0], client_handler);
+	setFdContext(reactor, pair[0], client);
+	bucket_init(&client->bucket, reactor, listener_pair[0]);
+
+	reactor_node_ptr node = test_node(pair[0]);
+
+	for (uint32_t i = 0; i < burst; ++i)
+		throttled += bucket_consume(client, reactor, pair[0], 1);
+
+	// One message over the burst owes a tenth of a second.
+	wait = bucket_consume(client, reactor, pair[0], 1);
+
+	if (client->bucket.limit.msgs_per_sec != 10 || throttled != 0 || wait < 50000 || wait > 100001 || node == NULL || !node->paused || node->resume_at == 0)
+	{
+		test_report("rate_limit", false, (client->bucket.limit.msgs_per_sec != 10 ? "the client didn't get the listener's limits" :
+					"the client wasn't throttled right after its burst"));
+		close(listener_pair[1]);
+		close(pair[1]);
+		test_teardown();
+		return;
+	}
+
+	started = test_now_ms();
+	startReactor(reactor);
+
+	while (node->paused && test_now_ms() - started < TEST_TIMEOUT_MS)
+		test_sleep(1);
+
+	resumed = test_now_ms();
+	stopReactor(reactor);
+
+	if (node->paused || resumed - started + 5 < wait / 1000 || resumed - started > wait / 1000 + 200)
+	{
+		test_report("rate_limit", false, "the client wasn't resumed once its debt was paid back");
+		close(listener_pair[1]);
+		close(pair[1]);
+		test_teardown();
+		return;
+	}
+
+	// Idle for longer than a burst - the bucket is full again, but holds no more than a burst.
+	test_sleep(SERVER_RATE_BURST_MS + 200);
+
+	for (uint32_t i = 0; i < burst; ++i)
+		throttled += bucket_consume(client, reactor, pair[0], 1);
+
+	wait = bucket_consume(client, reactor, pair[0], 1);
+
+	test_report("rate_limit", throttled == 0 && wait > 0 && client->throttled == 2, "the bucket didn't refill up to a single burst");
+
+	close(listener_pair[1]);
+	close(pair[1]);
+	test_teardown();
+}
+
+/*
+ * @brief The client that fills the server up pauses its listeners, which turn away whoever still gets through, and resume only
+ * 			once enough clients left. Out of file descriptors, the reserved one is spent to turn the pending connection away.
+*/
+static void test_admission() {
+	const listener_t listener = { "test", AF_UNIX, TEST_SOCKET_PATH, true, server_handler, { 0, 0 } };
+	int listener_fd = -1, fds[3] = { -1, -1, -1 }, client_fd = -1, free_fd = -1;
+	const char *reason = NULL;
+	struct rlimit limit, low;
+
+	if (!test_setup() || (listener_fd = create_listener(&listener)) < 0 || getrlimit(RLIMIT_NOFILE, &limit) < 0)
+	{
+		test_report("admission", false, strerror(errno));
+		return;
+	}
+
+	addListener(reactor, listener_fd, server_handler);
+
+	reactor_node_ptr node = test_node(listener_fd);
+
+	// The last client that fits.
+	active_clients = SERVER_MAX_CLIENTS - 1;
+	fds[0] = test_connect();
+	client_fd = accept_client(reactor, listener_fd, NULL, NULL);
+
+	if (client_fd < 0 || !admission_paused || node == NULL || !node->paused || node->resume_at != 0 ||
+		admission_resume != (uint32_t)((uint64_t)SERVER_MAX_CLIENTS * (100 - SERVER_ADMIT_HYSTERESIS) / 100))
+		reason = "the listeners weren't paused once the server was full";
+
+	if (client_fd >= 0)
+		close(client_fd);
+
+	// Whoever still gets through is turned away.
+	active_clients = SERVER_MAX_CLIENTS;
+	fds[1] = test_connect();
+
+	if (reason == NULL && (accept_client(reactor, listener_fd, NULL, NULL) >= 0 || !test_refused(fds[1])))
+		reason = "a connection to a full server wasn't turned away";
+
+	// A single client leaving isn't enough, the server must get down to admission_resume clients.
+	client_disconnected();
+
+	if (reason == NULL && (!admission_paused || !node->paused))
+		reason = "the listeners were resumed right below the limit";
+
+	active_clients = admission_resume + 1;
+	client_disconnected();
+
+	if (reason == NULL && (admission_paused || node->paused))
+		reason = "the listeners weren't resumed once enough clients left";
+
+	// Out of file descriptors - the next free one is over the limit.
+	active_clients = 0;
+	fds[2] = test_connect();
+
+	if (reserve_fd < 0)
+		reserve_fd = open("/dev/null", O_RDONLY);
+
+	if ((free_fd = dup(STDIN_FILENO)) >= 0)
+		close(free_fd);
+
+	low = limit;
+	low.rlim_cur = (rlim_t)free_fd;
+
+	if (reason == NULL && (free_fd < 0 || reserve_fd < 0 || setrlimit(RLIMIT_NOFILE, &low) < 0))
+		reason = strerror(errno);
+
+	else if (reason == NULL)
+	{
+		client_fd = accept_client(reactor, listener_fd, NULL, NULL);
+		setrlimit(RLIMIT_NOFILE, &limit);
+
+		if (client_fd >= 0 || !test_refused(fds[2]) || reserve_fd < 0 || !node->paused || node->resume_at == 0)
+			reason = "the reserved file descriptor wasn't spent on the pending connection";
+	}
+
+	test_report("admission", reason == NULL, reason);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	if (client_fd >= 0)
+		close(client_fd);
+
+	close(reserve_fd);
+	reserve_fd = -1;
+	admission_paused = false;
+	active_clients = 0;
+
+	unlink(TEST_SOCKET_PATH);
+	test_teardown();
+}
+
+/*
+ * @brief A listener and a client handed off over a socket come out on the other side as they went in - the client
+ * 			keeps its state and its connection, and the server its lifetime client count.
+*/
+static void test_handoff() {
+	const listener_t listener = { "test", AF_UNIX, TEST_SOCKET_PATH, true, server_handler, { 0, 0 } };
+	int sock[2] = { -1, -1 }, pair[2] = { -1, -1 }, listener_fd = -1, sent = 0, received = 0;
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t)), taken = NULL;
+	reactor_node_ptr taken_listener = NULL, taken_client = NULL;
+	uint32_t sent_clients = 0;
+	bool took_clients = false;
+	char c = 0;
+
+	if (client == NULL || !test_setup() || socketpair(AF_UNIX, SOCK_STREAM, 0, sock) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 ||
+		(listener_fd = create_listener(&listener)) < 0)
+	{
+		test_report("handoff", false, strerror(errno));
+		free(client);
+		return;
+	}
+
+	client->id = 7;
+	client->bytes_received = 1234;
+	client->bytes_sent = 5678;
+	client->bucket.limit.bytes_per_sec = 100;
+	client->bucket.limit.msgs_per_sec = 10;
+	client->bucket.msgs = 2.5;
+	client->bucket.last_refill = 42;
+	client->throttled = 3;
+	client->udp_token = 0x1122334455667788ULL;
+
+	addListener(reactor, listener_fd, server_handler);
+	addFd(reactor, pair[0], client_handler);
+	setFdContext(reactor, pair[0], client);
+	client_count = 41;
+
+	sent = handoff_send(sock[0], true, &sent_clients);
+
+	// The new process starts from scratch.
+	void *old_reactor = reactor;
+
+	client_count = 0;
+	active_clients = 0;
+
+	if (sent != 1 || sent_clients != 1 || !test_setup())
+	{
+		test_report("handoff", false, "the listener and the client weren't sent");
+
+		if (reactor != NULL && reactor != old_reactor)
+			test_teardown();
+
+		close(sock[0]);
+		close(sock[1]);
+		close(pair[1]);
+		reactor = old_reactor;
+		unlink(TEST_SOCKET_PATH);
+		test_teardown();
+		return;
+	}
+
+	received = handoff_receive(sock[1], &took_clients);
+
+	for (reactor_node_ptr curr = ((reactor_t_ptr)reactor)->head; curr != NULL; curr = curr->next)
+	{
+		if (curr->type == FD_TYPE_LISTENER)
+			taken_listener = curr;
+
+		else if (curr->type == FD_TYPE_CLIENT)
+			taken_client = curr;
+	}
+
+	taken = (taken_client != NULL ? (client_t_ptr)taken_client->ctx : NULL);
+
+	if (received != 1 || !took_clients || taken_listener == NULL || taken == NULL || client_count != 41 || active_clients != 1)
+		test_report("handoff", false, "the listener or the client weren't taken over");
+
+	else if (taken->id != 7 || taken->bytes_received != 1234 || taken->bytes_sent != 5678 || taken->bucket.limit.bytes_per_sec != 100 ||
+			taken->bucket.limit.msgs_per_sec != 10 || taken->bucket.msgs != 2.5 || taken->bucket.last_refill != 42 || taken->throttled != 3 ||
+			taken->udp_token != 0x1122334455667788ULL)
+		test_report("handoff", false, "the client's state changed on the way");
+
+	// The taken over file descriptor is another one, for the same connection.
+	else
+		test_report("handoff", taken_client->fd != pair[0] && write(taken_client->fd, "x", 1) == 1 && recv(pair[1], &c, 1, MSG_DONTWAIT) == 1 && c == 'x',
+					"the client's connection didn't come along");
+
+	close(sock[0]);
+	close(sock[1]);
+	close(pair[1]);
+	test_teardown();
+
+	reactor = old_reactor;
+	active_clients = 0;
+	client_count = 0;
+
+	unlink(TEST_SOCKET_PATH);
+	test_teardown();
+}
+
+int main() {
+	// The reactor logs every call to stdout, so the results go to a copy of it, and stdout goes to /dev/null - and so do
+	// the warnings on stderr, which the tests provoke on purpose.
+	int out_fd = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+
+	if (out_fd < 0 || null_fd < 0 || (out = fdopen(out_fd, "w")) == NULL)
+	{
+		fprintf(stderr, "Failed to redirect stdout: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	dup2(null_fd, STDOUT_FILENO);
+	dup2(null_fd, STDERR_FILENO);
+	close(null_fd);
+	setvbuf(out, NULL, _IONBF, 0);
+
+	test_coroutine_hangup();
+	test_coroutine_relay_full();
+	test_coroutine_cancel();
+	test_channel_wakeups();
+	test_shm_ring_wrap();
+	test_log_rollover();
+	test_rate_limit();
+	test_admission();
+	test_handoff();
+
+	fprintf(out, "%d failed.\n", failures);
+	fclose(out);
+
+	return (failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,590 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Needed for memmem().
+#define _GNU_SOURCE
+
+#include "capture.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// The default port of the server, as in reactor.h.
+#define REPLAY_PORT			9034
+
+// How often a latency probe is sent through the server, in milliseconds.
+#define REPLAY_PROBE_MS		10
+
+// The maximum number of probes waiting for their relay at once - more means they are lost (e.g. the server doesn't relay).
+#define REPLAY_PROBE_WINDOW	1024
+
+// For how long to wait for the last relays after the capture was replayed, in milliseconds.
+#define REPLAY_DRAIN_MS		1000
+
+// The size of the receive buffer, in bytes.
+#define REPLAY_BUFFER		65536
+
+// The format of a probe - it's relayed like any other message, and found again in the relayed stream.
+#define REPLAY_PROBE_FMT	"__replay_probe_%08lu__"
+
+// The prefix of every probe, followed by its ID and "__".
+#define REPLAY_PROBE_PREFIX	"__replay_probe_"
+
+// The length of a probe, in bytes.
+#define REPLAY_PROBE_LEN	25
+
+// The replayed connections, indexed by their reference ID in the capture, -1 if closed.
+static int *conns = NULL;
+
+// The number of entries in conns.
+static size_t conns_capacity = 0;
+
+// The address of the server.
+static struct sockaddr_in server_addr;
+
+// The connection that sends the probes, and the connection that receives their relays.
+static int probe_tx = -1, probe_rx = -1;
+
+// The ID of the next probe to send, and of the oldest probe that wasn't relayed back yet.
+static uint64_t probe_next = 0, probe_expected = 0;
+
+// The number of probes that never came back, though a later one did (e.g. the server dropped them).
+static uint64_t probe_missed = 0;
+
+// When each probe in the window was sent.
+static uint64_t probe_sent_at[REPLAY_PROBE_WINDOW];
+
+// When the next probe is due, in nanoseconds of the monotonic clock, or 0 to stop probing.
+static uint64_t probe_due = 0;
+
+// The tail of the relayed stream of the probe receiver, in case a probe is split between two reads.
+static char probe_carry[REPLAY_PROBE_LEN];
+
+// The length of probe_carry.
+static size_t probe_carry_len = 0;
+
+// The latencies of the probes, in nanoseconds.
+static uint64_t *latencies = NULL;
+
+// The number of latencies, and the capacity of the latencies array.
+static size_t latencies_count = 0, latencies_capacity = 0;
+
+// Statistics.
+static uint64_t chunks_sent = 0, bytes_sent = 0, bytes_received = 0, send_errors = 0;
+static size_t open_conns = 0, max_open_conns = 0, total_conns = 0;
+
+/*
+ * @brief Get the current time of the monotonic clock.
+ * @return The current time, in nanoseconds.
+*/
+static uint64_t replay_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * @brief Open a connection to the server.
+ * @return The connection, or -1 on failure.
+*/
+static int replay_connect() {
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+	{
+		fprintf(stderr, "connect() failed: %s\n", strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	// Every chunk goes out as it was captured, without being merged with the next one.
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return fd;
+}
+
+/*
+ * @brief Get the slot of a connection in conns, growing it if needed.
+ * @param conn The reference ID of the connection in the capture.
+ * @return A pointer to the slot, or NULL on failure.
+*/
+static int *replay_conn(uint32_t conn) {
+	if (conn >= conns_capacity)
+	{
+		size_t capacity = (conns_capacity == 0 ? 1024 : conns_capacity);
+
+		while (capacity <= conn)
+			capacity *= 2;
+
+		int *grown = (int *)realloc(conns, capacity * sizeof(int));
+
+		if (grown == NULL)
+			return NULL;
+
+		for (size_t i = conns_capacity; i < capacity; ++i)
+			grown[i] = -1;
+
+		conns = grown;
+		conns_capacity = capacity;
+	}
+
+	return &conns[conn];
+}
+
+/*
+ * @brief Close a replayed connection.
+ * @param slot The slot of the connection in conns.
+*/
+static void replay_close(int *slot) {
+	if (*slot < 0)
+		return;
+
+	close(*slot);
+	*slot = -1;
+	open_conns--;
+}
+
+/*
+ * @brief Find the relayed probes in a chunk of the probe receiver's stream, and record their latencies.
+ * @param data The chunk.
+ * @param len The length of the chunk, in bytes.
+*/
+static void replay_match_probes(const char *data, size_t len) {
+	char buf[REPLAY_BUFFER + REPLAY_PROBE_LEN], token[REPLAY_PROBE_LEN + 1];
+	size_t buf_len = probe_carry_len + len, offset = 0;
+
+	memcpy(buf, probe_carry, probe_carry_len);
+	memcpy(buf + probe_carry_len, data, len);
+
+	// Any probe that is still outstanding may be next, as the server may have dropped the ones before it.
+	while (probe_expected < probe_next)
+	{
+		char *found = (char *)memmem(buf + offset, buf_len - offset, REPLAY_PROBE_PREFIX, strlen(REPLAY_PROBE_PREFIX));
+
+		// A probe that is cut at the end of the chunk is kept for the next one.
+		if (found == NULL || (size_t)(buf + buf_len - found) < REPLAY_PROBE_LEN)
+		{
+			if (found != NULL)
+				offset = (size_t)(found - buf);
+
+			break;
+		}
+
+		unsigned long id = 0;
+		int end = 0;
+
+		offset = (size_t)(found - buf) + 1;
+
+		memcpy(token, found, REPLAY_PROBE_LEN);
+		token[REPLAY_PROBE_LEN] = '\0';
+
+		if (sscanf(token, REPLAY_PROBE_PREFIX "%8lu__%n", &id, &end) != 1 || end != REPLAY_PROBE_LEN)
+			continue;
+
+		offset = (size_t)(found - buf) + REPLAY_PROBE_LEN;
+
+		// Not a probe of this run, or one that was already counted.
+		if (id < probe_expected || id >= probe_next)
+			continue;
+
+		if (latencies_count == latencies_capacity)
+		{
+			size_t capacity = (latencies_capacity == 0 ? 4096 : latencies_capacity * 2);
+			uint64_t *grown = (uint64_t *)realloc(latencies, capacity * sizeof(uint64_t));
+
+			if (grown == NULL)
+				break;
+
+			latencies = grown;
+			latencies_capacity = capacity;
+		}
+
+		// Probes are relayed in the order they were sent, so the ones before it are lost.
+		probe_missed += id - probe_expected;
+		latencies[latencies_count++] = replay_now() - probe_sent_at[id % REPLAY_PROBE_WINDOW];
+		probe_expected = id + 1;
+	}
+
+	// Keep the tail, in case the next probe starts in it.
+	size_t tail = buf_len - offset;
+
+	if (tail > REPLAY_PROBE_LEN - 1)
+		tail = REPLAY_PROBE_LEN - 1;
+
+	memcpy(probe_carry, buf + buf_len - tail, tail);
+	probe_carry_len = tail;
+}
+
+/*
+ * @brief Send a probe if it's due, and read whatever the server relayed to all the connections.
+ * @param timeout_ms For how long to wait for the server, in milliseconds.
+ * @note The relays must be read all along, as the server blocks on clients that don't read.
+*/
+static void replay_service(int timeout_ms) {
+	static struct pollfd *pfds = NULL;
+	static int **slots = NULL;
+	static size_t pfds_capacity = 0;
+	char buf[REPLAY_BUFFER];
+	size_t count = 0;
+	uint64_t now = replay_now();
+
+	if (probe_due != 0 && now >= probe_due && probe_next - probe_expected < REPLAY_PROBE_WINDOW)
+	{
+		char token[REPLAY_PROBE_LEN + 1];
+
+		snprintf(token, sizeof(token), REPLAY_PROBE_FMT, (unsigned long)probe_next);
+		probe_sent_at[probe_next % REPLAY_PROBE_WINDOW] = now;
+
+		if (send(probe_tx, token, REPLAY_PROBE_LEN, MSG_DONTWAIT | MSG_NOSIGNAL) == REPLAY_PROBE_LEN)
+			probe_next++;
+
+		probe_due = now + REPLAY_PROBE_MS * 1000000ULL;
+	}
+
+	if (pfds_capacity < open_conns + 2)
+	{
+		size_t capacity = (open_conns + 2) * 2;
+		struct pollfd *grown_pfds = (struct pollfd *)realloc(pfds, capacity * sizeof(struct pollfd));
+		int **grown_slots = (int **)realloc(slots, capacity * sizeof(int *));
+
+		if (grown_pfds != NULL)
+			pfds = grown_pfds;
+
+		if (grown_slots != NULL)
+			slots = grown_slots;
+
+		if (grown_pfds == NULL || grown_slots == NULL)
+			return;
+
+		pfds_capacity = capacity;
+	}
+
+	pfds[count].fd = probe_rx;
+	pfds[count].events = POLLIN;
+	slots[count++] = &probe_rx;
+
+	pfds[count].fd = probe_tx;
+	pfds[count].events = POLLIN;
+	slots[count++] = &probe_tx;
+
+	for (size_t i = 0; i < conns_capacity && count < pfds_capacity; ++i)
+	{
+		if (conns[i] < 0)
+			continue;
+
+		pfds[count].fd = conns[i];
+		pfds[count].events = POLLIN;
+		slots[count++] = &conns[i];
+	}
+
+	if (poll(pfds, count, timeout_ms) <= 0)
+		return;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		ssize_t len = recv(pfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if (len > 0)
+		{
+			bytes_received += (uint64_t)len;
+
+			if (pfds[i].fd == probe_rx)
+				replay_match_probes(buf, (size_t)len);
+		}
+
+		// The server closed a replayed connection.
+		else if (len == 0 && slots[i] != &probe_rx && slots[i] != &probe_tx)
+			replay_close(slots[i]);
+	}
+}
+
+/*
+ * @brief Send a captured chunk on a connection, reading the relays meanwhile if the server is slow.
+ * @param fd The connection.
+ * @param data The chunk.
+ * @param len The length of the chunk, in bytes.
+*/
+static void replay_send(int fd, const char *data, size_t len) {
+	size_t offset = 0;
+
+	while (offset < len)
+	{
+		ssize_t ret = send(fd, data + offset, len - offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (ret > 0)
+		{
+			offset += (size_t)ret;
+			continue;
+		}
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			replay_service(1);
+			continue;
+		}
+
+		send_errors++;
+		return;
+	}
+
+	chunks_sent++;
+	bytes_sent += len;
+}
+
+/*
+ * @brief Compare two latencies, for qsort().
+*/
+static int replay_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	const char *host = "127.0.0.1";
+	double speed = 1.0;
+	int port = REPLAY_PORT, opt = 0;
+
+	while ((opt = getopt(argc, argv, "s:ma:p:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				speed = atof(optarg);
+				break;
+
+			case 'm':
+				speed = 0.0;
+				break;
+
+			case 'a':
+				host = optarg;
+				break;
+
+			case 'p':
+				port = atoi(optarg);
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-s speed | -m] [-a address] [-p port] capture_file\n", argv[0]);
+				fprintf(stderr, "\tReplays a capture file (SERVER_CAPTURE) against a server, by default 127.0.0.1:%d.\n", REPLAY_PORT);
+				fprintf(stderr, "\t-s replays N times faster than it was captured (default 1), -m as fast as possible.\n");
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || speed < 0.0)
+	{
+		fprintf(stderr, "Usage: %s [-s speed | -m] [-a address] [-p port] capture_file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((uint16_t)port);
+
+	if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "Invalid address: %s\n", host);
+		return EXIT_FAILURE;
+	}
+
+	int file = open(argv[optind], O_RDONLY);
+	struct stat st;
+
+	if (file < 0 || fstat(file, &st) < 0 || (size_t)st.st_size < sizeof(capture_header_t))
+	{
+		fprintf(stderr, "Can't read %s: %s\n", argv[optind], (file < 0 ? strerror(errno) : "too short"));
+
+		if (file >= 0)
+			close(file);
+
+		return EXIT_FAILURE;
+	}
+
+	size_t size = (size_t)st.st_size;
+	const char *capture = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+
+	close(file);
+
+	if (capture == MAP_FAILED || memcmp(((capture_header_t_ptr)capture)->magic, CAPTURE_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s isn't a capture file.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if ((probe_rx = replay_connect()) < 0 || (probe_tx = replay_connect()) < 0)
+		return EXIT_FAILURE;
+
+	size_t offset = sizeof(capture_header_t), records = 0;
+	uint64_t first = 0, max_lag = 0;
+	uint64_t start = replay_now();
+
+	probe_due = start;
+
+	while (offset + sizeof(capture_record_t) <= size)
+	{
+		capture_record_t record;
+
+		memcpy(&record, capture + offset, sizeof(record));
+		offset += sizeof(record);
+
+		if (offset + record.len > size)
+			break;
+
+		const char *data = capture + offset;
+
+		offset += record.len;
+
+		if (records++ == 0)
+			first = record.timestamp;
+
+		// Wait for the record's time, scaled by the speed, reading the relays meanwhile.
+		if (speed > 0.0)
+		{
+			uint64_t target = start + (uint64_t)((double)(record.timestamp - first) / speed), now = 0;
+
+			while ((now = replay_now()) < target)
+			{
+				uint64_t wake = (probe_due != 0 && probe_due < target ? probe_due : target);
+
+				replay_service((wake > now ? (int)((wake - now) / 1000000ULL) : 0));
+			}
+
+			if (now - target > max_lag)
+				max_lag = now - target;
+		}
+
+		else if (records % 64 == 0)
+			replay_service(0);
+
+		int *slot = replay_conn(record.conn);
+
+		if (slot == NULL)
+			break;
+
+		switch (record.kind)
+		{
+			case CAPTURE_ACCEPT:
+			{
+				replay_close(slot);
+
+				if ((*slot = replay_connect()) >= 0)
+				{
+					total_conns++;
+
+					if (++open_conns > max_open_conns)
+						max_open_conns = open_conns;
+				}
+
+				break;
+			}
+
+			case CAPTURE_DATA:
+			{
+				// A connection that was already open when the capture started.
+				if (*slot < 0 && (*slot = replay_connect()) >= 0)
+				{
+					total_conns++;
+
+					if (++open_conns > max_open_conns)
+						max_open_conns = open_conns;
+				}
+
+				if (*slot >= 0)
+					replay_send(*slot, data, record.len);
+
+				break;
+			}
+
+			case CAPTURE_DISCONNECT:
+				replay_close(slot);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	uint64_t elapsed = replay_now() - start;
+
+	// Wait for the last relays, without sending new probes.
+	probe_due = 0;
+
+	uint64_t drain_until = replay_now() + REPLAY_DRAIN_MS * 1000000ULL;
+
+	while (probe_expected < probe_next && replay_now() < drain_until)
+		replay_service(10);
+
+	for (size_t i = 0; i < conns_capacity; ++i)
+		replay_close(&conns[i]);
+
+	close(probe_tx);
+	close(probe_rx);
+	munmap((void *)capture, size);
+
+	double seconds = (double)elapsed / 1e9;
+
+	fprintf(stdout, "Replayed %zu records in %.3f seconds (%s).\n", records, seconds, (speed > 0.0 ? "scaled" : "max speed"));
+	fprintf(stdout, "Connections: %zu in total, %zu at once at most.\n", total_conns, max_open_conns);
+	fprintf(stdout, "Sent: %lu chunks, %lu bytes (%.1f chunks/s, %.3f MB/s), %lu failed.\n", chunks_sent, bytes_sent,
+					(seconds > 0 ? chunks_sent / seconds : 0.0), (seconds > 0 ? bytes_sent / seconds / (1024.0 * 1024.0) : 0.0), send_errors);
+	fprintf(stdout, "Received: %lu bytes of relays.\n", bytes_received);
+
+	if (speed > 0.0)
+		fprintf(stdout, "Schedule lag: %.3f ms at most.\n", (double)max_lag / 1e6);
+
+	if (latencies_count > 0)
+	{
+		qsort(latencies, latencies_count, sizeof(uint64_t), replay_compare);
+
+		fprintf(stdout, "Relay latency (%zu probes): p50 %.1f us, p99 %.1f us, max %.1f us, %lu lost (%lu missed, %lu never relayed).\n",
+						latencies_count, latencies[latencies_count / 2] / 1e3, latencies[(latencies_count * 99) / 100] / 1e3,
+						latencies[latencies_count - 1] / 1e3, probe_missed + probe_next - probe_expected, probe_missed, probe_next - probe_expected);
+	}
+
+	else
+		fprintf(stdout, "Relay latency: no probe was relayed back (is SERVER_RELAY enabled?).\n");
+
+	free(latencies);
+	free(conns);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Request SUS v3 (POSIX 2001) support, like reactor.h does for the server.
+#define _XOPEN_SOURCE 600
+
+#include "reactor.h"
+#include "shm_ring.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The maximum length of a relayed message, in bytes - a message of the server's maximum length, and its prefix.
+#define SHM_CLIENT_BUFFER	(MAX_BUFFER + SERVER_RLY_MSG_LEN)
+
+/*
+ * @brief Receive the handshake and the session's file descriptors from the server.
+ * @param sock The control socket.
+ * @param handshake The handshake to fill.
+ * @param fds Filled with the segment, the server doorbell and the client doorbell.
+ * @return 0 on success, -1 otherwise.
+*/
+static int shm_client_handshake(int sock, shm_handshake_t_ptr handshake, int fds[3]) {
+	struct iovec iov = { .iov_base = handshake, .iov_len = sizeof(shm_handshake_t) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&control, 0, sizeof(control));
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sock, &msg, MSG_WAITALL) != (ssize_t)sizeof(shm_handshake_t))
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+	return 0;
+}
+
+int main(void) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	shm_handshake_t handshake;
+	int fds[3] = { -1, -1, -1 };
+	char buf[SHM_CLIENT_BUFFER];
+	uint64_t ring = 1;
+
+	strncpy(addr.sun_path, SHM_SERVER_PATH, sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "connect(%s) failed: %s\n", SHM_SERVER_PATH, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (shm_client_handshake(sock, &handshake, fds) < 0 || handshake.segment_size != sizeof(shm_segment_t))
+	{
+		fprintf(stderr, "Shared-memory handshake failed.\n");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	shm_segment_t_ptr segment = (shm_segment_t_ptr)mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+	close(fds[0]);
+
+	if (segment == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Connected through shared memory, Reference ID: %u\n", handshake.client_id);
+
+	struct pollfd pfds[3] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = fds[2], .events = POLLIN },
+		{ .fd = sock, .events = POLLIN }
+	};
+
+	while (true)
+	{
+		if (poll(pfds, 3, -1) < 0)
+		{
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		// Messages relayed to us - reset the doorbell, then drain the ring.
+		if (pfds[1].revents & POLLIN)
+		{
+			uint64_t count = 0;
+			int len = 0;
+
+			if (read(fds[2], &count, sizeof(count)) < 0)
+				fprintf(stderr, "read() failed: %s\n", strerror(errno));
+
+			while ((len = shm_ring_pop(&segment->to_client, buf, sizeof(buf) - 1)) >= 0)
+			{
+				if (len > (int)sizeof(buf) - 1)
+					len = sizeof(buf) - 1;
+
+				buf[len] = '\0';
+				fprintf(stdout, "%s\n", buf);
+			}
+
+			fflush(stdout);
+		}
+
+		// A message to send - push it, then ring the server.
+		if (pfds[0].revents & (POLLIN | POLLHUP))
+		{
+			// The server takes at most MAX_BUFFER bytes of a message.
+			ssize_t len = read(STDIN_FILENO, buf, MAX_BUFFER);
+			bool wake = false;
+
+			if (len <= 0)
+				break;
+
+			while (!shm_ring_push(&segment->to_server, buf, len, &wake))
+				usleep(100);
+
+			if (wake && write(fds[1], &ring, sizeof(ring)) < 0)
+				fprintf(stderr, "write() failed: %s\n", strerror(errno));
+		}
+
+		if (pfds[2].revents & (POLLIN | POLLHUP))
+		{
+			fprintf(stderr, "Server closed the session.\n");
+			break;
+		}
+	}
+
+	munmap(segment, sizeof(shm_segment_t));
+	close(fds[1]);
+	close(fds[2]);
+	close(sock);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "shm_ring.h"
+#include <string.h>
+
+/*
+ * @brief Copy bytes into the ring data, wrapping around its end.
+ * @param ring A pointer to the ring.
+ * @param pos The free-running position to copy to.
+ * @param src The bytes to copy.
+ * @param len The number of bytes.
+*/
+static void shm_ring_write(shm_ring_t_ptr ring, uint32_t pos, const void *src, uint32_t len) {
+	uint32_t offset = pos & (SHM_RING_SIZE - 1);
+	uint32_t first = (len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset);
+
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+/*
+ * @brief Copy bytes out of the ring data, wrapping around its end.
+ * @param ring A pointer to the ring.
+ * @param pos The free-running position to copy from.
+ * @param dst The buffer to copy to.
+ * @param len The number of bytes.
+*/
+static void shm_ring_read(shm_ring_t_ptr ring, uint32_t pos, void *dst, uint32_t len) {
+	uint32_t offset = pos & (SHM_RING_SIZE - 1);
+	uint32_t first = (len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset);
+
+	memcpy(dst, ring->data + offset, first);
+	memcpy((char *)dst + first, ring->data, len - first);
+}
+
+bool shm_ring_push(shm_ring_t_ptr ring, const void *msg, uint32_t len, bool *wake) {
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (SHM_RING_SIZE - (head - tail) < sizeof(uint32_t) + (uint64_t)len)
+		return false;
+
+	shm_ring_write(ring, head, &len, sizeof(uint32_t));
+	shm_ring_write(ring, head + sizeof(uint32_t), msg, len);
+
+	// Publish the message only after its bytes are in place.
+	atomic_store_explicit(&ring->head, head + sizeof(uint32_t) + len, memory_order_release);
+
+	// Pairs with the fence in shm_ring_pop() - either the consumer sees the message before it goes to sleep,
+	// or the producer sees that it drained the ring, and rings its doorbell.
+	if (wake != NULL)
+	{
+		atomic_thread_fence(memory_order_seq_cst);
+		*wake = (atomic_load_explicit(&ring->tail, memory_order_relaxed) == head);
+	}
+
+	return true;
+}
+
+int shm_ring_pop(shm_ring_t_ptr ring, void *buf, uint32_t size) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t len = 0;
+
+	if (head == tail)
+	{
+		// Check again after a full fence, see shm_ring_push().
+		atomic_thread_fence(memory_order_seq_cst);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		if (head == tail)
+			return -1;
+	}
+
+	shm_ring_read(ring, tail, &len, sizeof(uint32_t));
+
+	// A corrupted length would make us read garbage forever, so drop the whole ring instead.
+	if (len > head - tail - sizeof(uint32_t))
+	{
+		atomic_store_explicit(&ring->tail, head, memory_order_release);
+		return -1;
+	}
+
+	shm_ring_read(ring, tail + sizeof(uint32_t), buf, (len < size ? len : size));
+
+	// Release the space only after the message was copied out.
+	atomic_store_explicit(&ring->tail, tail + sizeof(uint32_t) + len, memory_order_release);
+
+	return (int)len;
+}
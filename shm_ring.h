@@ -0,0 +1,202 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief The path of the Unix domain socket on which local clients request a shared-memory session.
+ * @note The default path is /tmp/react_server_shm.sock.
+*/
+#define SHM_SERVER_PATH		"/tmp/react_server_shm.sock"
+
+/*
+ * @brief The size of each ring (one per direction) in a shared-memory session, in bytes.
+ * @note The default size is 1 MB.
+ * @note Must be a power of 2, and large enough to hold at least one relayed message.
+*/
+#define SHM_RING_SIZE		(1 << 20)
+
+/*
+ * @brief The maximum number of messages the server takes from a client's ring per wakeup.
+ * @note The default value is 256 messages.
+ * @note Keeps a busy client from starving the other file descriptors - the rest is handled on the next round.
+*/
+#define SHM_DRAIN_BATCH		256
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief A single-producer single-consumer ring of length-prefixed messages, in shared memory.
+*/
+typedef struct _shm_ring shm_ring_t, *shm_ring_t_ptr;
+
+/*
+ * @brief The shared memory segment of a session - one ring per direction.
+*/
+typedef struct _shm_segment shm_segment_t, *shm_segment_t_ptr;
+
+/*
+ * @brief The handshake the server sends on the control socket, along with the segment and doorbells.
+*/
+typedef struct _shm_handshake shm_handshake_t, *shm_handshake_t_ptr;
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief A single-producer single-consumer ring of length-prefixed messages, in shared memory.
+ * @note Each message is a 32 bit length followed by the payload, and may wrap around the end of the data.
+ * @note The head and tail are free-running counters, kept on separate cache lines.
+*/
+struct _shm_ring
+{
+	/*
+	 * @brief The total number of bytes ever written to the ring, only written by the producer.
+	*/
+	_Atomic uint32_t head;
+
+	// Padding, to keep the head and the tail on separate cache lines.
+	char pad_head[60];
+
+	/*
+	 * @brief The total number of bytes ever read from the ring, only written by the consumer.
+	*/
+	_Atomic uint32_t tail;
+
+	// Padding, to keep the tail and the data on separate cache lines.
+	char pad_tail[60];
+
+	/*
+	 * @brief The ring data.
+	*/
+	char data[SHM_RING_SIZE];
+};
+
+/*
+ * @brief The shared memory segment of a session - one ring per direction.
+*/
+struct _shm_segment
+{
+	/*
+	 * @brief Messages from the client to the server.
+	*/
+	shm_ring_t to_server;
+
+	/*
+	 * @brief Messages relayed from the server to the client.
+	*/
+	shm_ring_t to_client;
+};
+
+/*
+ * @brief The handshake the server sends on the control socket.
+ * @note The message carries three file descriptors, in this order: the segment (memfd),
+ * 			the server's doorbell (eventfd) and the client's doorbell (eventfd).
+*/
+struct _shm_handshake
+{
+	/*
+	 * @brief The size of the segment, in bytes.
+	*/
+	uint32_t segment_size;
+
+	/*
+	 * @brief The client reference ID the server assigned to the session.
+	*/
+	uint32_t client_id;
+};
+
+
+/*
+ * @brief The server side of a shared-memory session.
+ * @note The session is the context of its server doorbell node in the reactor.
+*/
+struct _shm_session
+{
+	/*
+	 * @brief The mapped shared memory segment.
+	*/
+	shm_segment_t_ptr segment;
+
+	/*
+	 * @brief The control socket, used for the handshake and to detect the client leaving.
+	*/
+	int control_fd;
+
+	/*
+	 * @brief The eventfd the client rings after pushing messages to the server.
+	*/
+	int server_doorbell;
+
+	/*
+	 * @brief The eventfd the server rings after pushing messages to the client.
+	*/
+	int client_doorbell;
+
+	/*
+	 * @brief The number of messages dropped because the client's ring was full.
+	*/
+	uint64_t dropped;
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Push a message to a ring.
+ * @param ring A pointer to the ring.
+ * @param msg The message.
+ * @param len The length of the message, in bytes.
+ * @param wake Set to whether the consumer's doorbell must be rung for the message, or NULL.
+ * @return true on success, false if the ring doesn't have enough free space.
+ * @note Must only be called by the ring's single producer.
+ * @note The doorbell only has to be rung when the consumer had drained the ring before the message - it may be
+ * 			asleep. Otherwise, it's still draining, and finds the message with the ones before it (it must drain
+ * 			until shm_ring_pop() finds the ring empty, or ring its own doorbell to come back for the rest).
+*/
+bool shm_ring_push(shm_ring_t_ptr ring, const void *msg, uint32_t len, bool *wake);
+
+/*
+ * @brief Pop a message from a ring.
+ * @param ring A pointer to the ring.
+ * @param buf The buffer to copy the message to.
+ * @param size The size of the buffer, in bytes. Longer messages are truncated.
+ * @return The length of the message (before truncation), or -1 if the ring is empty.
+ * @note Must only be called by the ring's single consumer.
+*/
+int shm_ring_pop(shm_ring_t_ptr ring, void *buf, uint32_t size);
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Needed for memfd_create().
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "shm_ring.h"
+#include "capture.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The number of clients connected to the server in its lifetime.
+extern uint32_t client_count;
+
+// The number of clients currently connected to the server.
+extern uint32_t active_clients;
+
+/*
+ * @brief Release everything a shared-memory session holds, except the session itself.
+ * @param session The shared-memory session.
+ * @note The session is freed by the reactor, together with the node of its doorbell.
+*/
+static void shm_session_close(shm_session_t_ptr session) {
+	if (session->segment != NULL && session->segment != MAP_FAILED)
+		munmap(session->segment, sizeof(shm_segment_t));
+
+	if (session->server_doorbell >= 0)
+		close(session->server_doorbell);
+
+	if (session->client_doorbell >= 0)
+		close(session->client_doorbell);
+
+	session->segment = NULL;
+	session->server_doorbell = -1;
+	session->client_doorbell = -1;
+}
+
+/*
+ * @brief Send the handshake and the session's file descriptors on the control socket.
+ * @param session The shared-memory session.
+ * @param segment_fd The memfd of the segment.
+ * @param client_id The client reference ID.
+ * @return 0 on success, -1 otherwise.
+*/
+static int shm_session_handshake(shm_session_t_ptr session, int segment_fd, uint32_t client_id) {
+	shm_handshake_t handshake = { .segment_size = sizeof(shm_segment_t), .client_id = client_id };
+	int fds[3] = { segment_fd, session->server_doorbell, session->client_doorbell };
+	struct iovec iov = { .iov_base = &handshake, .iov_len = sizeof(handshake) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&control, 0, sizeof(control));
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(session->control_fd, &msg, 0) != (ssize_t)sizeof(handshake))
+	{
+		fprintf(stderr, "%s sendmsg() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Create the doorbells and the shared memory segment of a new session.
+ * @param session The shared-memory session.
+ * @return The memfd of the segment on success, -1 otherwise.
+*/
+static int shm_session_create(shm_session_t_ptr session) {
+	session->server_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	session->client_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (session->server_doorbell < 0 || session->client_doorbell < 0)
+	{
+		fprintf(stderr, "%s eventfd() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	int segment_fd = memfd_create("react_server_shm", MFD_CLOEXEC);
+
+	if (segment_fd < 0)
+	{
+		fprintf(stderr, "%s memfd_create() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(segment_fd, sizeof(shm_segment_t)) < 0)
+	{
+		fprintf(stderr, "%s ftruncate() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(segment_fd);
+		return -1;
+	}
+
+	session->segment = (shm_segment_t_ptr)mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+
+	if (session->segment == MAP_FAILED)
+	{
+		fprintf(stderr, "%s mmap() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(segment_fd);
+		return -1;
+	}
+
+	return segment_fd;
+}
+
+void *shm_server_handler(int fd, void *react) {
+	if (react == NULL)
+	{
+		fprintf(stderr, "%s Shared-memory handler error: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return NULL;
+	}
+
+	int control_fd = accept_client(react, fd, NULL, NULL);
+
+	// The listener stays, whether or not a client was admitted.
+	if (control_fd < 0)
+		return react;
+
+	shm_session_t_ptr session = (shm_session_t_ptr)calloc(1, sizeof(shm_session_t));
+	client_t_ptr client = (client_t_ptr)calloc(1, sizeof(client_t));
+
+	if (session == NULL || client == NULL)
+	{
+		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		free(session);
+		free(client);
+		close(control_fd);
+		return react;
+	}
+
+	session->control_fd = control_fd;
+	session->server_doorbell = -1;
+	session->client_doorbell = -1;
+
+	int segment_fd = shm_session_create(session);
+
+	client->id = client_count + 1;
+	client->shm = session;
+
+	bucket_init(&client->bucket, react, fd);
+
+	if (segment_fd < 0 || shm_session_handshake(session, segment_fd, client->id) < 0)
+	{
+		if (segment_fd >= 0)
+			close(segment_fd);
+
+		shm_session_close(session);
+		free(session);
+		free(client);
+		close(control_fd);
+		return react;
+	}
+
+	// Both ends have the segment mapped now, the memfd itself isn't needed anymore.
+	close(segment_fd);
+
+	client_count++;
+
+	fprintf(stdout, "%s Client shm:%d connected, Reference ID: %u\n", C_PREFIX_INFO, control_fd, client->id);
+
+	if (SERVER_CAPTURE)
+		capture_accept(client->id);
+
+	// The control socket stands for the client, the doorbell owns the session.
+	addFd(react, control_fd, shm_control_handler);
+	setFdContext(react, control_fd, client);
+
+	addInternalFd(react, session->server_doorbell, shm_doorbell_handler);
+	setFdContext(react, session->server_doorbell, session);
+
+	active_clients++;
+
+	return react;
+}
+
+void *shm_control_handler(int fd, void *react) {
+	client_t_ptr client = (client_t_ptr)getFdContext(react, fd);
+	char buf[64];
+
+	ssize_t bytes_read = recv(fd, buf, sizeof(buf), 0);
+
+	// Messages only go through the rings, anything else on the control socket is ignored.
+	if (bytes_read > 0)
+		return react;
+
+	if (bytes_read < 0)
+		fprintf(stderr, "%s recv() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	else
+		fprintf(stdout, "%s Client %u disconnected.\n", C_PREFIX_WARNING, (client != NULL ? client->id : (uint32_t)fd));
+
+	if (SERVER_CAPTURE && client != NULL)
+		capture_disconnect(client->id);
+
+	if (client != NULL && client->shm != NULL)
+	{
+		int doorbell = client->shm->server_doorbell;
+
+		if (client->shm->dropped > 0)
+			fprintf(stdout, "%s Client %u dropped %lu messages, its ring was full.\n", C_PREFIX_WARNING, client->id, client->shm->dropped);
+
+		shm_session_close(client->shm);
+		removeFd(react, doorbell);
+		client->shm = NULL;
+	}
+
+	client_disconnected();
+	close(fd);
+
+	return NULL;
+}
+
+void *shm_doorbell_handler(int fd, void *react) {
+	shm_session_t_ptr session = (shm_session_t_ptr)getFdContext(react, fd);
+	uint64_t count = 0;
+	int bytes_read = 0;
+
+	if (session == NULL || session->segment == NULL)
+		return NULL;
+
+	// Reset the doorbell before draining, so a message pushed meanwhile rings it again.
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "%s read() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	char *buf = (char *)calloc(MAX_BUFFER, sizeof(char));
+
+	if (buf == NULL)
+	{
+		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return react;
+	}
+
+	client_t_ptr client = (client_t_ptr)getFdContext(react, session->control_fd);
+	int handled = 0;
+
+	while ((bytes_read = shm_ring_pop(&session->segment->to_server, buf, MAX_BUFFER)) >= 0)
+	{
+		if (bytes_read == 0)
+			continue;
+
+		if (bytes_read > MAX_BUFFER)
+			bytes_read = MAX_BUFFER;
+
+		if (SERVER_CAPTURE && client != NULL)
+			capture_data(client->id, buf, bytes_read);
+
+		handle_message(react, session->control_fd, client, buf, bytes_read);
+
+		// A throttled client's messages are left in its ring, which pushes back on it once full.
+		// The doorbell is rung again, so they are drained when the pause is over.
+		if (bucket_consume(client, react, fd, bytes_read))
+		{
+			count = 1;
+
+			if (write(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+			fprintf(stdout, "%s Client %u went over its rate limit, throttled.\n", C_PREFIX_WARNING, client->id);
+			break;
+		}
+
+		// The rest is left for the next round, the doorbell is rung again so it comes.
+		if (++handled == SHM_DRAIN_BATCH)
+		{
+			count = 1;
+
+			if (write(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+			break;
+		}
+	}
+
+	free(buf);
+
+	return react;
+}
+
+bool shm_session_send(shm_session_t_ptr session, const char *msg, size_t len) {
+	uint64_t ring = 1;
+	bool wake = false;
+
+	if (session == NULL || session->segment == NULL)
+		return false;
+
+	if (!shm_ring_push(&session->segment->to_client, msg, len, &wake))
+	{
+		session->dropped++;
+		return false;
+	}
+
+	// A client that is still draining its ring gets the message without another syscall.
+	if (wake && write(session->client_doorbell, &ring, sizeof(ring)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	return true;
+}
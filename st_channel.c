@@ -0,0 +1,223 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "channel.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * @brief The handler of a channel's doorbell - hands the waiting messages to the channel's handler.
+ * @param fd The doorbell.
+ * @param react The receiving reactor.
+ * @return The reactor, or NULL if the doorbell has no channel.
+*/
+static void *channelHandler(int fd, void *react) {
+	channel_t_ptr channel = (channel_t_ptr)getFdContext(react, fd);
+	uint64_t count = 0;
+	size_t handled = 0;
+
+	if (channel == NULL)
+		return NULL;
+
+	// Reset the doorbell before draining. The producer doesn't ring it again while this drains.
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "%s read() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	atomic_store_explicit(&channel->armed, false, memory_order_relaxed);
+
+	size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+
+	while (handled < CHANNEL_BATCH)
+	{
+		if (tail == atomic_load_explicit(&channel->head, memory_order_acquire))
+		{
+			// Out of messages - arm the doorbell, then check again. Pairs with the fence in channelFlush() - either
+			// this load sees the messages sent meanwhile, or the producer sees the doorbell armed, and rings it.
+			atomic_store_explicit(&channel->armed, true, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			if (tail == atomic_load_explicit(&channel->head, memory_order_acquire))
+				break;
+
+			atomic_store_explicit(&channel->armed, false, memory_order_relaxed);
+		}
+
+		channel_msg_t_ptr msg = channel->slots[tail & (CHANNEL_CAPACITY - 1)];
+
+		atomic_store_explicit(&channel->tail, ++tail, memory_order_release);
+
+		channel->handler(msg, react);
+		channelMsgRelease(msg);
+
+		handled++;
+	}
+
+	// The batch is over before the channel was found empty, so the doorbell isn't armed - ring it, to handle the rest
+	// (or to arm it) on the next round.
+	if (handled == CHANNEL_BATCH)
+	{
+		count = 1;
+
+		if (write(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+	}
+
+	return react;
+}
+
+channel_msg_t_ptr channelMsgCreate(const void *data, uint32_t len, int sender) {
+	channel_msg_t_ptr msg = (channel_msg_t_ptr)malloc(sizeof(channel_msg_t) + len);
+
+	if (msg == NULL)
+	{
+		fprintf(stderr, "%s malloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return NULL;
+	}
+
+	atomic_init(&msg->refs, 1);
+	msg->sender = sender;
+	msg->len = len;
+
+	if (len > 0)
+		memcpy(msg->data, data, len);
+
+	return msg;
+}
+
+void channelMsgRetain(channel_msg_t_ptr msg) {
+	atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+}
+
+void channelMsgRelease(channel_msg_t_ptr msg) {
+	if (msg != NULL && atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1)
+		free(msg);
+}
+
+void *createChannel(void *react, channel_handler_t handler) {
+	if (react == NULL || handler == NULL)
+	{
+		fprintf(stderr, "%s createChannel() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return NULL;
+	}
+
+	channel_t_ptr channel = (channel_t_ptr)aligned_alloc(64, sizeof(channel_t));
+
+	if (channel == NULL)
+	{
+		fprintf(stderr, "%s aligned_alloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return NULL;
+	}
+
+	memset(channel, 0, sizeof(channel_t));
+
+	atomic_init(&channel->head, 0);
+	atomic_init(&channel->tail, 0);
+	atomic_init(&channel->armed, true);
+	channel->handler = handler;
+
+	if ((channel->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "%s eventfd() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		free(channel);
+		return NULL;
+	}
+
+	// The receiving reactor owns the channel from now on, as the context of its doorbell.
+	addInternalFd(react, channel->doorbell, channelHandler);
+	setFdContext(react, channel->doorbell, channel);
+
+	if (getFdContext(react, channel->doorbell) != channel)
+	{
+		close(channel->doorbell);
+		free(channel);
+		return NULL;
+	}
+
+	return channel;
+}
+
+bool channelSend(void *channel, channel_msg_t_ptr msg) {
+	channel_t_ptr chan = (channel_t_ptr)channel;
+
+	if (chan == NULL || msg == NULL)
+		return false;
+
+	size_t head = atomic_load_explicit(&chan->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&chan->tail, memory_order_acquire) >= CHANNEL_CAPACITY)
+	{
+		chan->dropped++;
+		return false;
+	}
+
+	channelMsgRetain(msg);
+
+	chan->slots[head & (CHANNEL_CAPACITY - 1)] = msg;
+	atomic_store_explicit(&chan->head, head + 1, memory_order_release);
+
+	chan->pending++;
+
+	return true;
+}
+
+void channelFlush(void *channel) {
+	channel_t_ptr chan = (channel_t_ptr)channel;
+
+	if (chan == NULL || chan->pending == 0)
+		return;
+
+	chan->pending = 0;
+
+	// Pairs with the fence in channelHandler() - either the receiving reactor sees the new messages
+	// while it's still draining, or it armed the doorbell before going idle, and it's woken up.
+	atomic_thread_fence(memory_order_seq_cst);
+
+	// Only the first flush after the receiving reactor went idle rings, until it wakes up.
+	if (!atomic_load_explicit(&chan->armed, memory_order_relaxed) || !atomic_exchange_explicit(&chan->armed, false, memory_order_relaxed))
+		return;
+
+	uint64_t ring = 1;
+
+	if (write(chan->doorbell, &ring, sizeof(ring)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "%s write() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	chan->wakeups++;
+}
+
+void destroyChannel(void *react, void *channel) {
+	channel_t_ptr chan = (channel_t_ptr)channel;
+
+	if (react == NULL || chan == NULL)
+		return;
+
+	size_t tail = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&chan->head, memory_order_acquire);
+
+	// Messages nobody received anymore.
+	while (tail != head)
+		channelMsgRelease(chan->slots[(tail++) & (CHANNEL_CAPACITY - 1)]);
+
+	int doorbell = chan->doorbell;
+
+	// Removing the doorbell frees the channel, its context.
+	removeFd(react, doorbell);
+	close(doorbell);
+}
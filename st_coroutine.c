@@ -0,0 +1,556 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// Needed for MAP_STACK.
+#define _GNU_SOURCE
+
+#include "coroutine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/*
+ * @brief The coroutine currently running in this thread, or NULL.
+*/
+static _Thread_local coroutine_t_ptr co_current = NULL;
+
+/*
+ * @brief Free stacks kept for reuse, per thread - each reactor thread keeps its own, so no locking is needed.
+*/
+static _Thread_local void *co_pool[CO_POOL_SIZE];
+
+/*
+ * @brief The number of free stacks in the pool.
+*/
+static _Thread_local size_t co_pool_count = 0;
+
+#if CO_FAST_SWITCH
+/*
+ * @brief Save the callee-saved registers on the current stack, and switch to another stack saved the same way.
+ * @param save_sp Filled with the current stack pointer.
+ * @param load_sp The stack pointer to switch to.
+ * @note Written in assembly below. The SSE and x87 control words are saved too, everything else is
+ * 			caller-saved, and the signal mask is left alone - no system call is made.
+*/
+void coroutineSwapStacks(void **save_sp, void *load_sp) __attribute__((visibility("hidden")));
+
+__asm__(
+	".text\n"
+	".globl coroutineSwapStacks\n"
+	".hidden coroutineSwapStacks\n"
+	".type coroutineSwapStacks, @function\n"
+	"coroutineSwapStacks:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coroutineSwapStacks, .-coroutineSwapStacks\n"
+);
+#endif
+
+/*
+ * @brief Find the node of a file descriptor in the reactor list.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to look for.
+ * @return A pointer to the node, or NULL if the file descriptor isn't in the list.
+*/
+static reactor_node_ptr coroutineFindNode(void *react, int fd) {
+	reactor_node_ptr curr = ((reactor_t_ptr)react)->head;
+
+	while (curr != NULL && curr->fd != fd)
+		curr = curr->next;
+
+	return curr;
+}
+
+/*
+ * @brief Get a stack for a new coroutine, from the pool if possible.
+ * @return The stack mapping, guard page included, or NULL on failure.
+*/
+static void *coroutineStackAlloc() {
+	if (co_pool_count > 0)
+		return co_pool[--co_pool_count];
+
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	void *stack = mmap(NULL, CO_STACK_SIZE + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+	if (stack == MAP_FAILED)
+	{
+		fprintf(stderr, "%s mmap() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return NULL;
+	}
+
+	// The stack grows down, so the guard page is the lowest one.
+	if (mprotect(stack, page, PROT_NONE) < 0)
+	{
+		fprintf(stderr, "%s mprotect() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		munmap(stack, CO_STACK_SIZE + page);
+		return NULL;
+	}
+
+	return stack;
+}
+
+/*
+ * @brief Return a stack to the pool, or unmap it if the pool is full.
+ * @param stack The stack mapping.
+*/
+static void coroutineStackFree(void *stack) {
+	if (co_pool_count < CO_POOL_SIZE)
+	{
+		co_pool[co_pool_count++] = stack;
+		return;
+	}
+
+	munmap(stack, CO_STACK_SIZE + (size_t)sysconf(_SC_PAGESIZE));
+}
+
+/*
+ * @brief Free a coroutine that isn't running, and stop whatever it waits on.
+ * @param co The coroutine.
+*/
+static void coroutineFree(coroutine_t_ptr co) {
+	if (co->wait_fd >= 0)
+	{
+		reactor_node_ptr node = coroutineFindNode(co->react, co->wait_fd);
+
+		if (node != NULL)
+		{
+			node->co = NULL;
+			removeFd(co->react, co->wait_fd);
+		}
+
+		if (co->wait_dup)
+			close(co->wait_fd);
+	}
+
+	if (co->timer_fd >= 0)
+		close(co->timer_fd);
+
+	coroutineStackFree(co->stack);
+	free(co);
+}
+
+/*
+ * @brief Switch between the reactor and a coroutine.
+ * @param co The coroutine.
+ * @param resume true to switch from the reactor to the coroutine, false to yield back to the reactor.
+*/
+static void coroutineSwitch(coroutine_t_ptr co, bool resume) {
+#if CO_FAST_SWITCH
+	if (resume)
+		coroutineSwapStacks(&co->caller_sp, co->sp);
+
+	else
+		coroutineSwapStacks(&co->sp, co->caller_sp);
+#else
+	if (swapcontext((resume ? &co->caller : &co->context), (resume ? &co->context : &co->caller)) < 0)
+		fprintf(stderr, "%s swapcontext() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+#endif
+}
+
+/*
+ * @brief The entry point of every coroutine, runs its body on its own stack.
+ * @note When it returns, the coroutine goes back to the reactor for good.
+*/
+static void coroutineEntry() {
+	coroutine_t_ptr co = co_current;
+
+	co->func(co->fd, co->react, co->arg);
+	co->finished = true;
+
+#if CO_FAST_SWITCH
+	// There's nothing to return to on the coroutine's own stack, it's never resumed again.
+	coroutineSwitch(co, false);
+	abort();
+#endif
+}
+
+/*
+ * @brief Switch from the reactor to a coroutine, until it yields or finishes.
+ * @param co The coroutine.
+*/
+static void coroutineResume(coroutine_t_ptr co) {
+	coroutine_t_ptr prev = co_current;
+
+	co_current = co;
+	co->running = true;
+
+	coroutineSwitch(co, true);
+
+	co->running = false;
+	co_current = prev;
+}
+
+/*
+ * @brief Suspend a coroutine until one of its file descriptors is ready.
+ * @param co The coroutine, must be the one running.
+ * @param fd The file descriptor to wait on.
+ * @param events The events to wait for, POLLIN or POLLOUT.
+ * @return 0 on success, -1 otherwise.
+ * @note Waiting on any other file descriptor than the coroutine's own adds it to the reactor for the
+ * 			duration of the wait, and pauses the coroutine's own meanwhile. One that's already in the reactor
+ * 			is added through a duplicate, as the reactor keeps a single handler per file descriptor.
+*/
+static int coroutineWait(coroutine_t_ptr co, int fd, short events);
+
+/*
+ * @brief The handler of every file descriptor a coroutine waits on - resumes the coroutine.
+ * @param fd The ready file descriptor.
+ * @param react The reactor.
+ * @return The reactor, or NULL if the file descriptor has no coroutine.
+*/
+static void *coroutineHandler(int fd, void *react) {
+	reactor_node_ptr node = coroutineFindNode(react, fd);
+
+	if (node == NULL || node->co == NULL)
+		return NULL;
+
+	coroutine_t_ptr co = (coroutine_t_ptr)node->co;
+
+	coroutineResume(co);
+
+	// The coroutine's file descriptor was removed while it ran, its node is already gone.
+	if (co->released)
+		coroutineFree(co);
+
+	else if (co->finished)
+		removeFd(react, co->fd);
+
+	return react;
+}
+
+static int coroutineWait(coroutine_t_ptr co, int fd, short events) {
+	// Nothing wakes a cancelled coroutine up again.
+	if (co->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	if (fd == co->fd)
+	{
+		// The node is gone once the coroutine is released.
+		if (co->released)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+
+		co->node->events = events;
+
+		coroutineSwitch(co, false);
+
+		if (co->cancelled)
+		{
+			errno = ECANCELED;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	bool dup_fd = false;
+
+	// A file descriptor that's already in the reactor has a handler of its own, so its duplicate is waited on.
+	if (coroutineFindNode(co->react, fd) != NULL)
+	{
+		if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		{
+			fprintf(stderr, "%s fcntl(F_DUPFD_CLOEXEC) failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+			return -1;
+		}
+
+		dup_fd = true;
+	}
+
+	addInternalFd(co->react, fd, coroutineHandler);
+
+	reactor_node_ptr node = coroutineFindNode(co->react, fd);
+
+	if (node == NULL)
+	{
+		if (dup_fd)
+			close(fd);
+
+		return -1;
+	}
+
+	node->co = co;
+	node->events = events;
+	co->wait_fd = fd;
+	co->wait_dup = dup_fd;
+
+	if (!co->released)
+		pauseFd(co->react, co->fd, 0);
+
+	coroutineSwitch(co, false);
+
+	if ((node = coroutineFindNode(co->react, fd)) != NULL)
+	{
+		node->co = NULL;
+		removeFd(co->react, fd);
+	}
+
+	if (dup_fd)
+		close(fd);
+
+	co->wait_fd = -1;
+	co->wait_dup = false;
+
+	if (!co->released)
+		resumeFd(co->react, co->fd);
+
+	if (co->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	return 0;
+}
+
+int co_spawn(void *react, int fd, co_func_t func, void *arg) {
+	if (react == NULL || func == NULL || fd < 0)
+	{
+		fprintf(stderr, "%s co_spawn() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		errno = EINVAL;
+		return -1;
+	}
+
+	coroutine_t_ptr co = (coroutine_t_ptr)calloc(1, sizeof(coroutine_t));
+
+	if (co == NULL)
+	{
+		fprintf(stderr, "%s calloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	if ((co->stack = coroutineStackAlloc()) == NULL)
+	{
+		free(co);
+		return -1;
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		fprintf(stderr, "%s co_spawn() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		coroutineStackFree(co->stack);
+		free(co);
+		return -1;
+	}
+
+#if CO_FAST_SWITCH
+	// The first switch to the coroutine pops what coroutineSwapStacks() would have saved, and returns into
+	// coroutineEntry(), with the stack aligned as if it was called.
+	uint64_t *top = (uint64_t *)((char *)co->stack + sysconf(_SC_PAGESIZE) + CO_STACK_SIZE);
+
+	*(--top) = 0;							// The return address of coroutineEntry(), it never returns.
+	*(--top) = (uint64_t)(uintptr_t)coroutineEntry;
+	top -= 6;								// rbp, rbx, r12 - r15.
+	memset(top, 0, 6 * sizeof(uint64_t));
+	*(--top) = 0x037F00001F80ULL;			// The default x87 and SSE control words.
+
+	co->sp = top;
+#else
+	if (getcontext(&co->context) < 0)
+	{
+		fprintf(stderr, "%s getcontext() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		coroutineStackFree(co->stack);
+		free(co);
+		return -1;
+	}
+
+	co->context.uc_stack.ss_sp = (char *)co->stack + sysconf(_SC_PAGESIZE);
+	co->context.uc_stack.ss_size = CO_STACK_SIZE;
+	co->context.uc_link = &co->caller;
+
+	makecontext(&co->context, coroutineEntry, 0);
+#endif
+
+	co->react = react;
+	co->fd = fd;
+	co->wait_fd = -1;
+	co->timer_fd = -1;
+	co->func = func;
+	co->arg = arg;
+
+	addFd(react, fd, coroutineHandler);
+
+	reactor_node_ptr node = coroutineFindNode(react, fd);
+
+	if (node == NULL)
+	{
+		coroutineStackFree(co->stack);
+		free(co);
+		return -1;
+	}
+
+	// A new file descriptor is almost always writable, so the coroutine starts on the next round.
+	co->node = node;
+	node->co = co;
+	node->events = POLLOUT;
+
+	return 0;
+}
+
+int co_wait(int fd, short events) {
+	// Waiting outside a coroutine would block the whole reactor.
+	if (co_current == NULL)
+	{
+		errno = EPERM;
+		return -1;
+	}
+
+	return coroutineWait(co_current, fd, events);
+}
+
+ssize_t co_read(int fd, void *buf, size_t len) {
+	ssize_t ret = 0;
+
+	if (co_current != NULL && co_current->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	while ((ret = read(fd, buf, len)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && co_current != NULL)
+	{
+		if (coroutineWait(co_current, fd, POLLIN) < 0)
+			return -1;
+	}
+
+	return ret;
+}
+
+ssize_t co_write(int fd, const void *buf, size_t len) {
+	size_t written = 0;
+
+	if (co_current != NULL && co_current->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	while (written < len)
+	{
+		ssize_t ret = write(fd, (const char *)buf + written, len - written);
+
+		if (ret >= 0)
+		{
+			written += (size_t)ret;
+			continue;
+		}
+
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || co_current == NULL || coroutineWait(co_current, fd, POLLOUT) < 0)
+			return (written > 0 ? (ssize_t)written : -1);
+	}
+
+	return (ssize_t)written;
+}
+
+int co_sleep(uint64_t usec) {
+	coroutine_t_ptr co = co_current;
+
+	// Sleeping outside a coroutine would block the whole reactor.
+	if (co == NULL)
+	{
+		errno = EPERM;
+		return -1;
+	}
+
+	if (co->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	its.it_value.tv_sec = (time_t)(usec / 1000000ULL);
+	its.it_value.tv_nsec = (long)((usec % 1000000ULL) * 1000ULL);
+
+	// A zero timer is disarmed, and would never fire.
+	if (usec == 0)
+		its.it_value.tv_nsec = 1;
+
+	if ((co->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "%s timerfd_create() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	int ret = timerfd_settime(co->timer_fd, 0, &its, NULL);
+
+	if (ret < 0)
+		fprintf(stderr, "%s timerfd_settime() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+	else
+		ret = coroutineWait(co, co->timer_fd, POLLIN);
+
+	close(co->timer_fd);
+	co->timer_fd = -1;
+
+	return ret;
+}
+
+void coroutineRelease(void *co, int fd) {
+	coroutine_t_ptr coroutine = (coroutine_t_ptr)co;
+
+	// A file descriptor the coroutine only waits on doesn't own it.
+	if (coroutine == NULL || coroutine->fd != fd)
+		return;
+
+	coroutine->released = true;
+	coroutine->cancelled = true;
+
+	// A running coroutine is freed once it yields, see coroutineHandler().
+	if (coroutine->running)
+		return;
+
+	// A suspended one runs its cleanup first (e.g. closes its client), as its waits now fail right away.
+	if (!coroutine->finished)
+		coroutineResume(coroutine);
+
+	coroutineFree(coroutine);
+}
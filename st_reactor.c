@@ -16,7 +16,15 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+// Needed for CPU affinity (pthread_attr_setaffinity_np) and syscall().
+#define _GNU_SOURCE
+
 #include "reactor.h"
+#include "coroutine.h"
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
@@ -26,6 +34,171 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+/*
+ * @brief Find the node of a file descriptor in the reactor list.
+ * @param reactor A pointer to the reactor object.
+ * @param fd The file descriptor to look for.
+ * @return A pointer to the node, or NULL if the file descriptor isn't in the list.
+*/
+static reactor_node_ptr reactorFindNode(reactor_t_ptr reactor, int fd) {
+	reactor_node_ptr curr = reactor->head;
+
+	while (curr != NULL && curr->fd != fd)
+		curr = curr->next;
+
+	return curr;
+}
+
+/*
+ * @brief Unlink a node from the reactor list and free it.
+ * @param reactor A pointer to the reactor object.
+ * @param node The node to remove.
+ * @note The automatic removal never removes listeners, see reactorAutoRemove().
+*/
+static void reactorRemoveNode(reactor_t_ptr reactor, reactor_node_ptr node) {
+	reactor_node_ptr curr_node = reactor->head;
+	reactor_node_ptr prev_node = NULL;
+
+	if (node == NULL)
+		return;
+
+	while (curr_node != NULL && curr_node != node)
+		curr_node = curr_node->next;
+
+	if (curr_node == NULL)
+		return;
+
+	// A coroutine goes away with its file descriptor. It's cancelled while its node and context are still there,
+	// and may remove other nodes as it unwinds (e.g. one it waited on), so the node is looked up again after.
+	if (node->co != NULL)
+	{
+		void *co = node->co;
+
+		node->co = NULL;
+		coroutineRelease(co, node->fd);
+	}
+
+	for (curr_node = reactor->head; curr_node != NULL && curr_node != node; curr_node = curr_node->next)
+		prev_node = curr_node;
+
+	if (curr_node == NULL)
+		return;
+
+	if (prev_node == NULL)
+		reactor->head = curr_node->next;
+
+	else
+		prev_node->next = curr_node->next;
+
+	free(curr_node->ctx);
+	free(curr_node);
+}
+
+/*
+ * @brief Remove a failing file descriptor from the reactor, unless it's a listener.
+ * @param reactor A pointer to the reactor object.
+ * @param fd The failing file descriptor.
+*/
+static void reactorAutoRemove(reactor_t_ptr reactor, int fd) {
+	reactor_node_ptr node = reactorFindNode(reactor, fd);
+
+	if (node != NULL && node->type != FD_TYPE_LISTENER)
+		reactorRemoveNode(reactor, node);
+}
+
+/*
+ * @brief Add a new node to the end of the reactor list.
+ * @param react A pointer to the reactor object.
+ * @param fd The file descriptor to add.
+ * @param handler The handler function to call when the file descriptor is ready.
+ * @param type The role of the file descriptor.
+*/
+static void reactorAddNode(void *react, int fd, handler_t handler, fd_type_t type) {
+	if (react == NULL || handler == NULL || fd < 0 || fcntl(fd, F_GETFL) == -1)
+	{
+		fprintf(stderr, "%s %s() failed: %s\n", C_PREFIX_ERROR, (type == FD_TYPE_LISTENER ? "addListener" : (type == FD_TYPE_INTERNAL ? "addInternalFd" : "addFd")), strerror(EINVAL));
+		return;
+	}
+
+	fprintf(stdout, "%s Adding %s file descriptor %d to the list.\n", C_PREFIX_INFO, (type == FD_TYPE_LISTENER ? "listener" : (type == FD_TYPE_INTERNAL ? "internal" : "client")), fd);
+
+	reactor_t_ptr reactor = (reactor_t_ptr)react;
+	reactor_node_ptr node = (reactor_node_ptr)malloc(sizeof(reactor_node));
+
+	if (node == NULL)
+	{
+		fprintf(stderr, "%s malloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return;
+	}
+
+	node->fd = fd;
+	node->type = type;
+	node->hdlr.handler = handler;
+	node->paused = false;
+	node->resume_at = 0;
+	node->events = POLLIN;
+	node->co = NULL;
+	node->ctx = NULL;
+	node->next = NULL;
+
+	if (reactor->head == NULL)
+		reactor->head = node;
+
+	else
+	{
+		reactor_node_ptr curr = reactor->head;
+
+		while (curr->next != NULL)
+			curr = curr->next;
+
+		curr->next = node;
+	}
+
+	fprintf(stdout, "%s Successfuly added file descriptor %d to the list, function handler address: %p.\n", C_PREFIX_INFO, fd, node->hdlr.handler_ptr);
+}
+
+/*
+ * @brief Get the current time of the monotonic clock, in nanoseconds.
+ * @return The current time, in nanoseconds.
+*/
+static uint64_t reactorNow() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * @brief Make sure the reactor's poll array can hold at least the given number of file descriptors.
+ * @param reactor A pointer to the reactor object.
+ * @param size The number of file descriptors.
+ * @return 0 on success, -1 otherwise.
+ * @note The array is only grown, never shrunk, so the steady state doesn't allocate at all.
+*/
+static int reactorReserveFds(reactor_t_ptr reactor, size_t size) {
+	if (size <= reactor->fds_capacity)
+		return 0;
+
+	size_t capacity = (reactor->fds_capacity == 0 ? 16 : reactor->fds_capacity);
+
+	while (capacity < size)
+		capacity *= 2;
+
+	pollfd_t_ptr fds = (pollfd_t_ptr)realloc(reactor->fds, capacity * sizeof(pollfd_t));
+
+	if (fds == NULL)
+		return -1;
+
+	// Touch the new part from the reactor thread, so its pages are placed on the local NUMA node.
+	memset(fds + reactor->fds_capacity, 0, (capacity - reactor->fds_capacity) * sizeof(pollfd_t));
+
+	reactor->fds = fds;
+	reactor->fds_capacity = capacity;
+
+	return 0;
+}
+
 void *reactorRun(void *react) {
 	if (react == NULL)
 	{
@@ -35,10 +208,27 @@ void *reactorRun(void *react) {
 	}
 
 	reactor_t_ptr reactor = (reactor_t_ptr)react;
+	uint64_t spin_ns = (uint64_t)reactor->options.spin_usec * 1000ULL;
+	uint64_t last_event = reactorNow();
+
+	if (reactor->options.numa_local)
+	{
+		// Allocate everything the reactor thread touches from now on on its own NUMA node,
+		// even if the process was started with another policy (e.g. numactl --interleave).
+		if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0)
+			fprintf(stderr, "%s set_mempolicy() failed: %s\n", C_PREFIX_WARNING, strerror(errno));
+
+		if (reactorReserveFds(reactor, MAX_QUEUE) < 0)
+		{
+			fprintf(stderr, "%s reactorRun() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+			return NULL;
+		}
+	}
 
 	while (reactor->running)
 	{
 		size_t size = 0, i = 0;
+		uint64_t now = reactorNow(), wake_at = 0;
 		reactor_node_ptr curr = reactor->head;
 
 		while (curr != NULL)
@@ -49,9 +239,7 @@ void *reactorRun(void *react) {
 
 		curr = reactor->head;
 
-		reactor->fds = (pollfd_t_ptr)calloc(size, sizeof(pollfd_t));
-
-		if (reactor->fds == NULL)
+		if (reactorReserveFds(reactor, size) < 0)
 		{
 			fprintf(stderr, "%s reactorRun() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
 			return NULL;
@@ -59,80 +247,95 @@ void *reactorRun(void *react) {
 
 		while (curr != NULL)
 		{
+			// Paused file descriptors are left out, until their pause is over.
+			if (curr->paused)
+			{
+				if (curr->resume_at != 0 && curr->resume_at <= now)
+					curr->paused = false;
+
+				else
+				{
+					if (curr->resume_at != 0 && (wake_at == 0 || curr->resume_at < wake_at))
+						wake_at = curr->resume_at;
+
+					curr = curr->next;
+					continue;
+				}
+			}
+
 			(*(reactor->fds + i)).fd = curr->fd;
-			(*(reactor->fds + i)).events = POLLIN;
+			(*(reactor->fds + i)).events = curr->events;
+			(*(reactor->fds + i)).revents = 0;
 
 			curr = curr->next;
 			i++;
 		}
 
-		int ret = poll(reactor->fds, i, POLL_TIMEOUT);
+		// Adaptive spinning - keep polling without sleeping for a while after the last event.
+		bool spinning = (spin_ns > 0 && now - last_event < spin_ns);
+		int timeout = (spinning ? 0 : POLL_TIMEOUT);
+
+		// Wake up in time to resume the first paused file descriptor.
+		if (wake_at != 0)
+		{
+			int wake_ms = (int)((wake_at - now + 999999ULL) / 1000000ULL);
+
+			if (timeout < 0 || wake_ms < timeout)
+				timeout = wake_ms;
+		}
+
+		int ret = poll(reactor->fds, i, timeout);
 
 		if (ret < 0)
 		{
+			// A signal landed on the reactor thread, the signal handler takes care of it.
+			if (errno == EINTR)
+				continue;
+
 			fprintf(stderr, "%s poll() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
-			free(reactor->fds);
-			reactor->fds = NULL;
 			return NULL;
 		}
 
 		else if (ret == 0)
 		{
-			fprintf(stdout, "%s poll() timed out.\n", C_PREFIX_WARNING);
-			free(reactor->fds);
-			reactor->fds = NULL;
+			if (!spinning && wake_at == 0)
+				fprintf(stdout, "%s poll() timed out.\n", C_PREFIX_WARNING);
+
 			continue;
 		}
 
-		for (i = 0; i < size; ++i)
-		{
-			if ((*(reactor->fds + i)).revents & POLLIN)
-			{
-				reactor_node_ptr curr = reactor->head;
-
-				for (unsigned int j = 0; j < i; ++j)
-					curr = curr->next;
+		if (spin_ns > 0)
+			last_event = reactorNow();
 
-				void *handler_ret = curr->hdlr.handler((*(reactor->fds + i)).fd, reactor);
+		size = i;
 
-				if (handler_ret == NULL && (*(reactor->fds + i)).fd != reactor->head->fd)
-				{
-					reactor_node_ptr curr_node = reactor->head;
-					reactor_node_ptr prev_node = NULL;
+		for (i = 0; i < size; ++i)
+		{
+			short revents = (*(reactor->fds + i)).revents;
 
-					while (curr_node != NULL && curr_node->fd != (*(reactor->fds + i)).fd)
-					{
-						prev_node = curr_node;
-						curr_node = curr_node->next;
-					}
+			if (revents == 0)
+				continue;
 
-					prev_node->next = curr_node->next;
-
-					free(curr_node);
-				}
+			// Handlers may add or remove nodes, so the node is looked up by its file
+			// descriptor rather than by its position in the list.
+			reactor_node_ptr curr = reactorFindNode(reactor, (*(reactor->fds + i)).fd);
 
+			if (curr == NULL)
 				continue;
-			}
 
-			else if (((*(reactor->fds + i)).revents & POLLHUP || (*(reactor->fds + i)).revents & POLLNVAL || (*(reactor->fds + i)).revents & POLLERR) && (*(reactor->fds + i)).fd != reactor->head->fd)
+			// A client (or coroutine) that hung up or failed goes through its handler too - its next read
+			// reports it, and it's closed and accounted for like any other disconnection.
+			if (revents & (POLLIN | POLLOUT) || (!(revents & POLLNVAL) && (curr->type == FD_TYPE_CLIENT || curr->co != NULL)))
 			{
-				reactor_node_ptr curr_node = reactor->head;
-				reactor_node_ptr prev_node = NULL;
-
-				while (curr_node != NULL && curr_node->fd != (*(reactor->fds + i)).fd)
-				{
-					prev_node = curr_node;
-					curr_node = curr_node->next;
-				}
-
-				prev_node->next = curr_node->next;
+				void *handler_ret = curr->hdlr.handler((*(reactor->fds + i)).fd, reactor);
 
-				free(curr_node);
+				if (handler_ret == NULL)
+					reactorAutoRemove(reactor, (*(reactor->fds + i)).fd);
 			}
-		}
 
-		free(reactor->fds);
-		reactor->fds = NULL;
+			else if (revents & (POLLHUP | POLLNVAL | POLLERR))
+				reactorAutoRemove(reactor, (*(reactor->fds + i)).fd);
+		}
 	}
 
 	fprintf(stdout, "%s Reactor thread finished.\n", C_PREFIX_INFO);
@@ -141,6 +344,10 @@ void *reactorRun(void *react) {
 }
 
 void *createReactor() {
+	return createReactorWithOptions(NULL);
+}
+
+void *createReactorWithOptions(const reactor_options_t *options) {
 	reactor_t_ptr react = NULL;
 
 	fprintf(stdout, "%s Creating reactor...\n", C_PREFIX_INFO);
@@ -154,8 +361,19 @@ void *createReactor() {
 	react->thread = 0;
 	react->head = NULL;
 	react->fds = NULL;
+	react->fds_capacity = 0;
 	react->running = false;
 
+	if (options != NULL)
+		react->options = *options;
+
+	else
+	{
+		react->options.cpu = REACTOR_CPU_AFFINITY;
+		react->options.numa_local = REACTOR_NUMA_LOCAL;
+		react->options.spin_usec = REACTOR_SPIN_USEC;
+	}
+
 	fprintf(stdout, "%s Reactor created.\n", C_PREFIX_INFO);
 
 	return react;
@@ -184,9 +402,45 @@ void startReactor(void *react) {
 
 	fprintf(stdout, "%s Starting reactor thread...\n", C_PREFIX_INFO);
 
+	pthread_attr_t attr;
+	int ret_val = pthread_attr_init(&attr);
+
+	if (ret_val != 0)
+	{
+		fprintf(stderr, "%s pthread_attr_init() failed: %s\n", C_PREFIX_ERROR, strerror(ret_val));
+		return;
+	}
+
+	if (reactor->options.cpu >= 0)
+	{
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(reactor->options.cpu, &cpuset);
+
+		// Pinning is an optimization, the reactor still works without it.
+		if ((ret_val = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset)) != 0)
+			fprintf(stderr, "%s pthread_attr_setaffinity_np() failed: %s\n", C_PREFIX_WARNING, strerror(ret_val));
+
+		else
+			fprintf(stdout, "%s Reactor thread is pinned to CPU %d.\n", C_PREFIX_INFO, reactor->options.cpu);
+	}
+
+	if (reactor->options.spin_usec > 0)
+		fprintf(stdout, "%s Reactor thread spins for %u microseconds after each event.\n", C_PREFIX_INFO, reactor->options.spin_usec);
+
 	reactor->running = true;
 
-	int ret_val = pthread_create(&reactor->thread, NULL, reactorRun, react);
+	ret_val = pthread_create(&reactor->thread, &attr, reactorRun, react);
+
+	// A CPU that doesn't exist (or isn't allowed) fails the creation, so try again without pinning.
+	if (ret_val == EINVAL && reactor->options.cpu >= 0)
+	{
+		fprintf(stderr, "%s CPU %d is unavailable, starting the reactor thread unpinned.\n", C_PREFIX_WARNING, reactor->options.cpu);
+		ret_val = pthread_create(&reactor->thread, NULL, reactorRun, react);
+	}
+
+	pthread_attr_destroy(&attr);
 
 	if (ret_val != 0)
 	{
@@ -251,6 +505,7 @@ void stopReactor(void *react) {
 	{
 		free(reactor->fds);
 		reactor->fds = NULL;
+		reactor->fds_capacity = 0;
 	}
 	
 	// Reset reactor pthread.
@@ -260,41 +515,122 @@ void stopReactor(void *react) {
 }
 
 void addFd(void *react, int fd, handler_t handler) {
-	if (react == NULL || handler == NULL || fd < 0 || fcntl(fd, F_GETFL) == -1 || errno == EBADF)
+	reactorAddNode(react, fd, handler, FD_TYPE_CLIENT);
+}
+
+void addListener(void *react, int fd, handler_t handler) {
+	reactorAddNode(react, fd, handler, FD_TYPE_LISTENER);
+}
+
+void addInternalFd(void *react, int fd, handler_t handler) {
+	reactorAddNode(react, fd, handler, FD_TYPE_INTERNAL);
+}
+
+void removeFd(void *react, int fd) {
+	if (react == NULL)
 	{
-		fprintf(stderr, "%s addFd() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		fprintf(stderr, "%s removeFd() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
 		return;
 	}
 
-	fprintf(stdout, "%s Adding file descriptor %d to the list.\n", C_PREFIX_INFO, fd);
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
 
-	reactor_t_ptr reactor = (reactor_t_ptr)react;
-	reactor_node_ptr node = (reactor_node_ptr)malloc(sizeof(reactor_node));
+	if (node == NULL)
+	{
+		fprintf(stderr, "%s removeFd() failed: %s\n", C_PREFIX_ERROR, strerror(ENOENT));
+		return;
+	}
+
+	reactorRemoveNode((reactor_t_ptr)react, node);
+
+	fprintf(stdout, "%s Removed file descriptor %d from the list.\n", C_PREFIX_INFO, fd);
+}
+
+void pauseFd(void *react, int fd, uint64_t usec) {
+	if (react == NULL)
+	{
+		fprintf(stderr, "%s pauseFd() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return;
+	}
+
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
 
 	if (node == NULL)
 	{
-		fprintf(stderr, "%s malloc() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		fprintf(stderr, "%s pauseFd() failed: %s\n", C_PREFIX_ERROR, strerror(ENOENT));
 		return;
 	}
 
-	node->fd = fd;
-	node->hdlr.handler = handler;
-	node->next = NULL;
+	node->paused = true;
+	node->resume_at = (usec == 0 ? 0 : reactorNow() + usec * 1000ULL);
+}
 
-	if (reactor->head == NULL)
-		reactor->head = node;
+void resumeFd(void *react, int fd) {
+	if (react == NULL)
+	{
+		fprintf(stderr, "%s resumeFd() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return;
+	}
 
-	else
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
+
+	if (node == NULL)
 	{
-		reactor_node_ptr curr = reactor->head;
+		fprintf(stderr, "%s resumeFd() failed: %s\n", C_PREFIX_ERROR, strerror(ENOENT));
+		return;
+	}
 
-		while (curr->next != NULL)
-			curr = curr->next;
+	node->paused = false;
+	node->resume_at = 0;
+}
 
-		curr->next = node;
+void setFdEvents(void *react, int fd, short events) {
+	if (react == NULL)
+	{
+		fprintf(stderr, "%s setFdEvents() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return;
 	}
 
-	fprintf(stdout, "%s Successfuly added file descriptor %d to the list, function handler address: %p.\n", C_PREFIX_INFO, fd, node->hdlr.handler_ptr);
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
+
+	if (node == NULL)
+	{
+		fprintf(stderr, "%s setFdEvents() failed: %s\n", C_PREFIX_ERROR, strerror(ENOENT));
+		return;
+	}
+
+	node->events = events;
+}
+
+void setFdContext(void *react, int fd, void *ctx) {
+	if (react == NULL)
+	{
+		fprintf(stderr, "%s setFdContext() failed: %s\n", C_PREFIX_ERROR, strerror(EINVAL));
+		return;
+	}
+
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
+
+	if (node == NULL)
+	{
+		fprintf(stderr, "%s setFdContext() failed: %s\n", C_PREFIX_ERROR, strerror(ENOENT));
+		free(ctx);
+		return;
+	}
+
+	if (node->ctx != ctx)
+		free(node->ctx);
+
+	node->ctx = ctx;
+}
+
+void *getFdContext(void *react, int fd) {
+	if (react == NULL)
+		return NULL;
+
+	reactor_node_ptr node = reactorFindNode((reactor_t_ptr)react, fd);
+
+	return (node == NULL ? NULL : node->ctx);
 }
 
 void WaitFor(void *react) {
@@ -307,7 +643,8 @@ void WaitFor(void *react) {
 	reactor_t_ptr reactor = (reactor_t_ptr)react;
 	void *ret = NULL;
 
-	if (!reactor->running)
+	// A thread that already stopped by itself (running was cleared from a handler) is still joined.
+	if (reactor->thread == 0)
 		return;
 
 	fprintf(stdout, "%s Reactor thread joined.\n", C_PREFIX_INFO);
@@ -320,6 +657,9 @@ void WaitFor(void *react) {
 		return;
 	}
 
+	reactor->thread = 0;
+	reactor->running = false;
+
 	if (ret == NULL)
 		fprintf(stderr, "%s Reactor thread fatal error: %s", C_PREFIX_ERROR, strerror(errno));
 }
\ No newline at end of file
@@ -0,0 +1,240 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Needed for struct ip_mreq (multicast group membership).
+#define _DEFAULT_SOURCE
+
+#include "udp_relay.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// The maximum length of a single datagram, in bytes.
+#define UDP_CLIENT_BUFFER	65536
+
+// Set by SIGINT, to unregister before exiting.
+static volatile sig_atomic_t udp_client_stop = 0;
+
+/*
+ * @brief Stop the client.
+ * @param sig The signal number.
+*/
+static void udp_client_signal(int sig) {
+	(void)sig;
+	udp_client_stop = 1;
+}
+
+/*
+ * @brief Connect to the server over TCP, and ask it for a UDP token.
+ * @param host The address of the server.
+ * @param token Where to store the token.
+ * @return The TCP socket, which must stay connected for as long as the token is used, or -1 on failure.
+*/
+static int udp_client_token(const char *host, uint64_t *token) {
+	struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(SERVER_PORT) };
+	char reply[64] = { 0 };
+	size_t len = 0;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sock < 0 || inet_pton(AF_INET, host, &server.sin_addr) != 1 || connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0 ||
+		send(sock, UDP_TOKEN_REQUEST, strlen(UDP_TOKEN_REQUEST), 0) < 0)
+	{
+		fprintf(stderr, "Connecting to %s:%d failed: %s\n", host, SERVER_PORT, strerror(errno));
+
+		if (sock >= 0)
+			close(sock);
+
+		return -1;
+	}
+
+	// The answer is a single line.
+	while (len < sizeof(reply) - 1 && memchr(reply, '\n', len) == NULL)
+	{
+		ssize_t ret = recv(sock, reply + len, sizeof(reply) - 1 - len, 0);
+
+		if (ret <= 0)
+			break;
+
+		len += (size_t)ret;
+	}
+
+	if (sscanf(reply, UDP_TOKEN_REPLY "%" SCNx64, token) != 1)
+	{
+		fprintf(stderr, "The server didn't send a UDP token, is SERVER_UDP_RELAY set?\n");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(UDP_PORT) };
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+	const char *host = "127.0.0.1";
+	char *buf = (char *)malloc(UDP_CLIENT_BUFFER);
+	bool multicast = false, started = false;
+	uint64_t expected = 0, missed = 0, token = 0;
+	char request[64];
+	int opt = 0, tcp = -1;
+
+	while ((opt = getopt(argc, argv, "ms:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm':
+				multicast = true;
+				break;
+
+			case 's':
+				host = optarg;
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-m] [-s server]\n", argv[0]);
+				fprintf(stderr, "\tWithout -m, connects to the server (default 127.0.0.1), registers with the token it got over TCP, and gets the messages in its sendmmsg() batches.\n");
+				fprintf(stderr, "\tWith -m, joins the multicast group %s:%d instead.\n", UDP_GROUP, UDP_GROUP_PORT);
+				free(buf);
+				return EXIT_FAILURE;
+		}
+	}
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (buf == NULL || sock < 0 || inet_pton(AF_INET, host, &server.sin_addr) != 1)
+	{
+		fprintf(stderr, "UDP client setup failed: %s\n", strerror(errno));
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	if (multicast)
+	{
+		struct ip_mreq mreq;
+		int reuse = 1;
+
+		addr.sin_port = htons(UDP_GROUP_PORT);
+
+		// Several subscribers on the same host share the group port.
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			inet_pton(AF_INET, UDP_GROUP, &mreq.imr_multiaddr) != 1 || inet_pton(AF_INET, UDP_INTERFACE, &mreq.imr_interface) != 1 ||
+			setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+		{
+			fprintf(stderr, "Joining %s failed: %s\n", UDP_GROUP, strerror(errno));
+			close(sock);
+			free(buf);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "Joined multicast group %s:%d\n", UDP_GROUP, UDP_GROUP_PORT);
+	}
+
+	// Only a client that is connected to the server may register an endpoint, with the token it got over its connection.
+	else if ((tcp = udp_client_token(host, &token)) < 0)
+	{
+		close(sock);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	else
+		fprintf(stderr, "Registering with %s:%d\n", host, UDP_PORT);
+
+	signal(SIGINT, udp_client_signal);
+	signal(SIGTERM, udp_client_signal);
+
+	struct pollfd pfd[2] = { { .fd = sock, .events = POLLIN }, { .fd = tcp, .events = POLLIN } };
+
+	while (!udp_client_stop)
+	{
+		// Register, and renew the registration before it expires.
+		snprintf(request, sizeof(request), "%s %016" PRIx64, UDP_SUBSCRIBE, token);
+
+		if (!multicast && sendto(sock, request, strlen(request), 0, (struct sockaddr *)&server, sizeof(server)) < 0)
+			fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
+
+		int ret = poll(pfd, (multicast ? 1 : 2), UDP_RENEW_INTERVAL * 1000);
+
+		// Nothing is relayed over TCP once the endpoint is registered, the connection only keeps the token valid - once it's closed, so is the registration.
+		if (ret > 0 && !multicast && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && recv(tcp, buf, UDP_CLIENT_BUFFER, MSG_DONTWAIT) == 0)
+		{
+			fprintf(stderr, "The server closed the connection.\n");
+			break;
+		}
+
+		while (ret > 0 && !udp_client_stop)
+		{
+			ssize_t len = recv(sock, buf, UDP_CLIENT_BUFFER - 1, MSG_DONTWAIT);
+
+			if (len < (ssize_t)sizeof(udp_header_t))
+				break;
+
+			udp_header_t_ptr header = (udp_header_t_ptr)buf;
+			uint64_t seq = ((uint64_t)ntohl(header->seq_high) << 32) | ntohl(header->seq_low);
+			uint32_t msg_len = ntohl(header->len);
+
+			if (msg_len > (size_t)len - sizeof(udp_header_t))
+				msg_len = (uint32_t)((size_t)len - sizeof(udp_header_t));
+
+			// Sequence numbers are consecutive, a jump means datagrams were lost on the way.
+			if (started && seq > expected)
+			{
+				missed += seq - expected;
+				fprintf(stderr, "Missed %lu messages (%lu in total).\n", seq - expected, missed);
+			}
+
+			started = true;
+			expected = seq + 1;
+
+			buf[sizeof(udp_header_t) + msg_len] = '\0';
+			fprintf(stdout, "[%lu] %s\n", seq, buf + sizeof(udp_header_t));
+		}
+
+		fflush(stdout);
+
+		if (ret < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	snprintf(request, sizeof(request), "%s %016" PRIx64, UDP_UNSUBSCRIBE, token);
+
+	if (!multicast && sendto(sock, request, strlen(request), 0, (struct sockaddr *)&server, sizeof(server)) < 0)
+		fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
+
+	fprintf(stderr, "Missed %lu messages in total.\n", missed);
+
+	if (tcp >= 0)
+		close(tcp);
+
+	close(sock);
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
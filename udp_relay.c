@@ -0,0 +1,385 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// Needed for sendmmsg().
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "udp_relay.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * @brief A registered endpoint, the token it registered with, the client the token belongs to,
+ * 			and when it last renewed its registration.
+ * @note The client outlives the endpoint, as its endpoints are unregistered when it leaves, see udp_relay_forget().
+*/
+typedef struct _udp_endpoint_t
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint64_t token;
+	client_t_ptr client;
+	time_t last_seen;
+} udp_endpoint_t, *udp_endpoint_t_ptr;
+
+// The UDP relay socket, or -1.
+static int udp_fd = -1;
+
+// The multicast group.
+static struct sockaddr_in udp_group;
+
+// The registered endpoints.
+static udp_endpoint_t endpoints[UDP_MAX_ENDPOINTS];
+
+// The number of registered endpoints.
+static size_t endpoints_count = 0;
+
+// The sequence number of the next message.
+static uint64_t udp_seq = 0;
+
+// The number of datagrams sent so far.
+static uint64_t udp_sent = 0;
+
+/*
+ * @brief Find a registered endpoint.
+ * @param addr The address of the endpoint.
+ * @param addr_len The length of the address.
+ * @return The index of the endpoint, or -1 if it isn't registered.
+*/
+static int udp_endpoint_find(const struct sockaddr_storage *addr, socklen_t addr_len) {
+	for (size_t i = 0; i < endpoints_count; ++i)
+	{
+		if (endpoints[i].addr_len == addr_len && memcmp(&endpoints[i].addr, addr, addr_len) == 0)
+			return (int)i;
+	}
+
+	return -1;
+}
+
+/*
+ * @brief Unregister an endpoint, by moving the last one to its place.
+ * @param index The index of the endpoint.
+*/
+static void udp_endpoint_remove(size_t index) {
+	// The client is relayed over TCP again once its last endpoint is gone.
+	if (endpoints[index].client != NULL && endpoints[index].client->udp_endpoints > 0)
+		endpoints[index].client->udp_endpoints--;
+
+	endpoints[index] = endpoints[--endpoints_count];
+}
+
+/*
+ * @brief Find the connected client a token belongs to.
+ * @param react The reactor.
+ * @param token The token.
+ * @return The client, or NULL if no connected client has the token.
+ * @note Walks the client list, it's only called for new registrations.
+*/
+static client_t_ptr udp_token_client(void *react, uint64_t token) {
+	reactor_node_ptr curr = ((reactor_t_ptr)react)->head;
+
+	if (token == 0)
+		return NULL;
+
+	while (curr != NULL)
+	{
+		if (curr->type == FD_TYPE_CLIENT && curr->ctx != NULL && ((client_t_ptr)curr->ctx)->udp_token == token)
+			return (client_t_ptr)curr->ctx;
+
+		curr = curr->next;
+	}
+
+	return NULL;
+}
+
+int udp_relay_open(void *react) {
+	struct sockaddr_in addr;
+	struct in_addr iface;
+	unsigned char ttl = UDP_TTL, loop = 1;
+	int reuse = 1, all = 0;
+
+	if ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		fprintf(stderr, "%s socket() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	memset(&udp_group, 0, sizeof(udp_group));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(UDP_PORT);
+
+	udp_group.sin_family = AF_INET;
+	udp_group.sin_port = htons(UDP_GROUP_PORT);
+
+	// An old process may still hold the port while it drains after a hot restart.
+	if (setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+		bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		inet_pton(AF_INET, UDP_GROUP, &udp_group.sin_addr) != 1 ||
+		inet_pton(AF_INET, UDP_INTERFACE, &iface) != 1 ||
+		setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0 ||
+		setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+		setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+		setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all)) < 0 ||
+		fcntl(udp_fd, F_SETFL, fcntl(udp_fd, F_GETFL) | O_NONBLOCK) < 0)
+	{
+		fprintf(stderr, "%s UDP relay setup failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+		close(udp_fd);
+		udp_fd = -1;
+		return -1;
+	}
+
+	addInternalFd(react, udp_fd, udp_relay_handler);
+
+	fprintf(stdout, "%s UDP relay to %s:%d, endpoints register on port %d.\n", C_PREFIX_INFO, (UDP_MULTICAST ? UDP_GROUP : "-"), UDP_GROUP_PORT, UDP_PORT);
+
+	return 0;
+}
+
+void udp_relay_close() {
+	if (udp_fd < 0)
+		return;
+
+	close(udp_fd);
+	udp_fd = -1;
+
+	while (endpoints_count > 0)
+		udp_endpoint_remove(endpoints_count - 1);
+}
+
+bool udp_relay_send(uint32_t sender, const char *msg, size_t len) {
+	struct mmsghdr batch[UDP_BATCH];
+	udp_header_t header;
+	time_t now = time(NULL);
+
+	if (udp_fd < 0)
+		return false;
+
+	header.seq_high = htonl((uint32_t)(udp_seq >> 32));
+	header.seq_low = htonl((uint32_t)udp_seq);
+	header.sender = htonl(sender);
+	header.len = htonl((uint32_t)len);
+
+	udp_seq++;
+
+	// The header and the message go out as one datagram, without copying them together.
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)msg, .iov_len = len }
+	};
+
+	if (UDP_MULTICAST)
+	{
+		struct msghdr hdr = { .msg_name = &udp_group, .msg_namelen = sizeof(udp_group), .msg_iov = iov, .msg_iovlen = 2 };
+
+		if (sendmsg(udp_fd, &hdr, 0) < 0)
+			fprintf(stderr, "%s sendmsg() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+		else
+			udp_sent++;
+	}
+
+	// Endpoints that didn't renew their registration are dropped on the way.
+	for (size_t i = 0; i < endpoints_count;)
+	{
+		if (now - endpoints[i].last_seen > UDP_ENDPOINT_TIMEOUT)
+			udp_endpoint_remove(i);
+
+		else
+			i++;
+	}
+
+	for (size_t first = 0; first < endpoints_count; first += UDP_BATCH)
+	{
+		unsigned int count = (unsigned int)(endpoints_count - first < UDP_BATCH ? endpoints_count - first : UDP_BATCH);
+
+		memset(batch, 0, count * sizeof(struct mmsghdr));
+
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			batch[i].msg_hdr.msg_name = &endpoints[first + i].addr;
+			batch[i].msg_hdr.msg_namelen = endpoints[first + i].addr_len;
+			batch[i].msg_hdr.msg_iov = iov;
+			batch[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		// sendmmsg() stops at the first datagram that fails, the rest of the batch is sent from there.
+		for (unsigned int done = 0; done < count;)
+		{
+			int ret = sendmmsg(udp_fd, batch + done, count - done, 0);
+
+			if (ret > 0)
+			{
+				done += (unsigned int)ret;
+				udp_sent += (uint64_t)ret;
+			}
+
+			// The socket is full - the rest of the batch is dropped, and the subscribers see the gap in the sequence numbers.
+			else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+			{
+				fprintf(stderr, "%s UDP relay can't keep up, %u datagrams dropped.\n", C_PREFIX_WARNING, count - done);
+				break;
+			}
+
+			// An endpoint that can't be sent to at all (e.g. unreachable) is skipped, and the others still get the message.
+			else
+			{
+				fprintf(stderr, "%s sendmmsg() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+				done++;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool udp_relay_request(int fd, client_t_ptr client, const char *buf) {
+	char reply[sizeof(UDP_TOKEN_REPLY) + 32];
+	size_t len = strlen(UDP_TOKEN_REQUEST);
+
+	if (client == NULL || client->shm != NULL || strncmp(buf, UDP_TOKEN_REQUEST, len) != 0)
+		return false;
+
+	// Only the request itself, maybe followed by a newline, is a request.
+	for (const char *p = buf + len; *p != '\0'; ++p)
+	{
+		if (*p != '\n' && *p != '\r' && *p != ' ')
+			return false;
+	}
+
+	while (client->udp_token == 0)
+	{
+		if (getrandom(&client->udp_token, sizeof(client->udp_token), 0) != sizeof(client->udp_token))
+		{
+			fprintf(stderr, "%s getrandom() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+			return true;
+		}
+	}
+
+	int reply_len = snprintf(reply, sizeof(reply), "%s%016" PRIx64 "\n", UDP_TOKEN_REPLY, client->udp_token);
+
+	if (send(fd, reply, (size_t)reply_len, MSG_NOSIGNAL) != reply_len)
+		fprintf(stderr, "%s Sending the UDP token to client %u failed: %s\n", C_PREFIX_WARNING, client->id, strerror(errno));
+
+	return true;
+}
+
+void udp_relay_forget(client_t_ptr client) {
+	if (client == NULL || client->udp_token == 0)
+		return;
+
+	for (size_t i = 0; i < endpoints_count;)
+	{
+		if (endpoints[i].token == client->udp_token)
+			udp_endpoint_remove(i);
+
+		else
+			i++;
+	}
+}
+
+void *udp_relay_handler(int fd, void *react) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	char buf[64];
+
+	ssize_t bytes_read = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addr_len);
+
+	if (bytes_read < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			fprintf(stderr, "%s recvfrom() failed: %s\n", C_PREFIX_ERROR, strerror(errno));
+
+		return react;
+	}
+
+	buf[bytes_read] = '\0';
+
+	int index = udp_endpoint_find(&addr, addr_len);
+	client_t_ptr client = NULL;
+	uint64_t token = 0;
+
+	// Both requests carry the token, anything without one is ignored.
+	if (sscanf(buf, UDP_UNSUBSCRIBE " %" SCNx64, &token) == 1)
+	{
+		if (index >= 0 && endpoints[index].token == token)
+		{
+			udp_endpoint_remove((size_t)index);
+			fprintf(stdout, "%s UDP endpoint unregistered, %zu left.\n", C_PREFIX_INFO, endpoints_count);
+		}
+	}
+
+	else if (sscanf(buf, UDP_SUBSCRIBE " %" SCNx64, &token) == 1)
+	{
+		// A renewal of an existing registration.
+		if (index >= 0 && endpoints[index].token == token)
+			endpoints[index].last_seen = time(NULL);
+
+		// The server only sends to the endpoints of clients that are connected over TCP, and not to any address
+		// that asked for it, or it could be used to flood someone else with datagrams.
+		else if ((client = udp_token_client(react, token)) == NULL)
+			fprintf(stderr, "%s UDP registration with an unknown token, ignored.\n", C_PREFIX_WARNING);
+
+		// The endpoint moved to another client.
+		else if (index >= 0)
+		{
+			if (endpoints[index].client != NULL && endpoints[index].client->udp_endpoints > 0)
+				endpoints[index].client->udp_endpoints--;
+
+			endpoints[index].token = token;
+			endpoints[index].client = client;
+			endpoints[index].last_seen = time(NULL);
+			client->udp_endpoints++;
+		}
+
+		else if (endpoints_count < UDP_MAX_ENDPOINTS)
+		{
+			endpoints[endpoints_count].addr = addr;
+			endpoints[endpoints_count].addr_len = addr_len;
+			endpoints[endpoints_count].token = token;
+			endpoints[endpoints_count].client = client;
+			endpoints[endpoints_count].last_seen = time(NULL);
+			endpoints_count++;
+			client->udp_endpoints++;
+
+			fprintf(stdout, "%s UDP endpoint registered, %zu in total.\n", C_PREFIX_INFO, endpoints_count);
+		}
+
+		else
+			fprintf(stderr, "%s Too many UDP endpoints, registration ignored.\n", C_PREFIX_WARNING);
+	}
+
+	return react;
+}
+
+uint64_t udp_relay_sent() {
+	return udp_sent;
+}
@@ -0,0 +1,232 @@
+/*
+ *  Operation Systems (OSs) Course Assignment 4
+ *  Reactor - A TCP server that handles multiple clients using a reactor.
+ *  Copyright (C) 2023  Roy Simanovich and Linor Ronen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UDP_RELAY_H
+#define _UDP_RELAY_H
+
+#include "reactor.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/********************/
+/* Settings Section */
+/********************/
+
+/*
+ * @brief Defines whether relayed messages are also sent over UDP, to read-mostly subscribers.
+ * @note The default value is 0.
+ * @note A value of 1 means that each message is sent once to the multicast group (UDP_MULTICAST), and in
+ * 			sendmmsg() batches to the registered endpoints. A TCP client with a registered endpoint gets the
+ * 			messages there, instead of over TCP - every other client, socket or shared memory, is relayed to as usual.
+ * 			Clients still send their messages (and their replay requests) over TCP.
+*/
+#define SERVER_UDP_RELAY	0
+
+/*
+ * @brief The UDP port on which subscribers register (and unregister) their endpoints.
+ * @note The default port is 9035.
+*/
+#define UDP_PORT			9035
+
+/*
+ * @brief Defines whether messages are sent to the multicast group.
+ * @note The default value is 1.
+*/
+#define UDP_MULTICAST		1
+
+/*
+ * @brief The multicast group messages are sent to.
+ * @note The default group is 239.255.0.34, in the organization-local scope.
+*/
+#define UDP_GROUP			"239.255.0.34"
+
+/*
+ * @brief The UDP port of the multicast group.
+ * @note The default port is 9036.
+ * @note Must differ from UDP_PORT, as Linux hands multicast datagrams to every socket bound to their port.
+*/
+#define UDP_GROUP_PORT		9036
+
+/*
+ * @brief The address of the interface multicast datagrams are sent from.
+ * @note The default address is 127.0.0.1, so it works on a single host out of the box.
+*/
+#define UDP_INTERFACE		"127.0.0.1"
+
+/*
+ * @brief The time-to-live of multicast datagrams.
+ * @note The default value is 1 - they never leave the local network.
+*/
+#define UDP_TTL				1
+
+/*
+ * @brief The maximum number of registered endpoints.
+ * @note The default number is 4096 endpoints.
+*/
+#define UDP_MAX_ENDPOINTS	4096
+
+/*
+ * @brief The number of datagrams sent with a single sendmmsg() call.
+ * @note The default number is 64 datagrams.
+*/
+#define UDP_BATCH			64
+
+/*
+ * @brief For how long an endpoint stays registered without renewing its registration, in seconds.
+ * @note The default timeout is 30 seconds.
+ * @note Subscribers are expected to register again periodically (every UDP_RENEW_INTERVAL seconds).
+*/
+#define UDP_ENDPOINT_TIMEOUT	30
+
+/*
+ * @brief How often subscribers renew their registration, in seconds.
+ * @note The default interval is 10 seconds.
+*/
+#define UDP_RENEW_INTERVAL	10
+
+/*
+ * @brief The datagram a subscriber sends to register its endpoint, followed by its token (in hex).
+ * @note Only a client that is connected over TCP gets a token, see UDP_TOKEN_REQUEST, so the server never
+ * 			sends datagrams to an address that merely claimed to want them.
+*/
+#define UDP_SUBSCRIBE		"SUBSCRIBE"
+
+/*
+ * @brief The datagram a subscriber sends to unregister its endpoint, followed by its token (in hex).
+*/
+#define UDP_UNSUBSCRIBE		"UNSUBSCRIBE"
+
+/*
+ * @brief The message a TCP client sends to get its UDP token.
+ * @note The server answers with UDP_TOKEN_REPLY and the token in hex, followed by a newline.
+ * @note The token is valid for as long as the client stays connected, and its endpoints are unregistered when it leaves.
+*/
+#define UDP_TOKEN_REQUEST	"/udp"
+
+/*
+ * @brief The prefix of the server's answer to UDP_TOKEN_REQUEST.
+*/
+#define UDP_TOKEN_REPLY		"UDP token: "
+
+
+/********************/
+/* Typedefs Section */
+/********************/
+
+/*
+ * @brief The header of every relayed datagram, followed by the message itself.
+*/
+typedef struct _udp_header_t udp_header_t, *udp_header_t_ptr;
+
+
+/**********************/
+/* Structures Section */
+/**********************/
+
+/*
+ * @brief The header of every relayed datagram, followed by the message itself.
+ * @note All the fields are in network byte order.
+*/
+struct _udp_header_t
+{
+	/*
+	 * @brief The sequence number of the message, high 32 bits.
+	 * @note Sequence numbers are consecutive, so a subscriber detects lost messages by the gaps.
+	*/
+	uint32_t seq_high;
+
+	/*
+	 * @brief The sequence number of the message, low 32 bits.
+	*/
+	uint32_t seq_low;
+
+	/*
+	 * @brief The reference ID of the client that sent the message.
+	*/
+	uint32_t sender;
+
+	/*
+	 * @brief The length of the message that follows, in bytes.
+	*/
+	uint32_t len;
+};
+
+
+/********************************/
+/* Functions Declartion Section */
+/********************************/
+
+/*
+ * @brief Open the UDP relay socket, and add it to the reactor for endpoint registrations.
+ * @param react The reactor.
+ * @return 0 on success, -1 otherwise.
+*/
+int udp_relay_open(void *react);
+
+/*
+ * @brief Close the UDP relay socket.
+ * @return void
+*/
+void udp_relay_close();
+
+/*
+ * @brief Send a message to the multicast group and to all the registered endpoints.
+ * @param sender The reference ID of the client that sent the message.
+ * @param msg The message.
+ * @param len The length of the message, in bytes.
+ * @return true if the message went out over UDP, false if the UDP relay isn't open.
+ * @note The message is sent once to the group, and with one sendmmsg() call per UDP_BATCH endpoints
+ * 			(more if the socket buffer fills up in the middle of a batch).
+*/
+bool udp_relay_send(uint32_t sender, const char *msg, size_t len);
+
+/*
+ * @brief Answer a client's request for its UDP token, see UDP_TOKEN_REQUEST.
+ * @param fd The file descriptor of the client.
+ * @param client The client.
+ * @param buf The message of the client, null-terminated.
+ * @return true if the message was a token request (and shouldn't be relayed), false otherwise.
+ * @note Shared-memory clients don't get a token, their messages are relayed as usual.
+*/
+bool udp_relay_request(int fd, client_t_ptr client, const char *buf);
+
+/*
+ * @brief Unregister the endpoints of a client that left.
+ * @note The number of endpoints a client has is kept in client_t::udp_endpoints, see relay_message().
+ * @param client The client.
+ * @return void
+*/
+void udp_relay_forget(client_t_ptr client);
+
+/*
+ * @brief A handler for the UDP relay socket - registers and unregisters endpoints.
+ * @param fd The UDP relay socket.
+ * @param react The reactor.
+ * @return The reactor.
+*/
+void *udp_relay_handler(int fd, void *react);
+
+/*
+ * @brief Get the number of datagrams sent so far.
+ * @return The number of datagrams.
+*/
+uint64_t udp_relay_sent();
+
+#endif